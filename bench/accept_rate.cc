@@ -0,0 +1,90 @@
+#include "bench.h"
+#include <mp/pthread.h>
+
+// Connections accepted per second by loop::listen. Client threads
+// connect and reset the connection as fast as they can.
+//
+//   --threads=1,2,4  loop threads of the server
+//   --clients=4      client threads
+//   --seconds=2      duration of a run
+
+static volatile int s_accepted = 0;
+
+static void accepted(int fd, int err)
+{
+	if(fd < 0) {
+		return;
+	}
+	__sync_add_and_fetch(&s_accepted, 1);
+	::close(fd);
+}
+
+struct client {
+	struct sockaddr_in addr;
+	double until;
+	int connected;
+};
+
+static void client_main(client* c)
+{
+	while(bench::now() < c->until) {
+		int fd = bench::connect_loopback(c->addr);
+		// reset instead of leaving the port in TIME_WAIT
+		struct linger lg = {1, 0};
+		setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+		::close(fd);
+		++c->connected;
+	}
+}
+
+static void run(int threads, int clients, double seconds)
+{
+	mp::wavy::loop lo;
+	s_accepted = 0;
+	struct sockaddr_in addr = bench::listen_loopback(lo, &accepted);
+	lo.start(threads);
+
+	double start = bench::now();
+	std::vector<client> cs(clients);
+	std::vector<mp::pthread_thread> ths(clients);
+	for(int i=0; i < clients; ++i) {
+		cs[i].addr = addr;
+		cs[i].until = start + seconds;
+		cs[i].connected = 0;
+		ths[i].run(mp::bind(&client_main, &cs[i]));
+	}
+
+	int connected = 0;
+	for(int i=0; i < clients; ++i) {
+		ths[i].join();
+		connected += cs[i].connected;
+	}
+	for(int i=0; i < 1000 && s_accepted < connected; ++i) {
+		usleep(1000);
+	}
+	double elapsed = bench::now() - start;
+
+	lo.end();
+	lo.join();
+
+	bench::result("accept")
+		("threads", threads)
+		("clients", clients)
+		("connects", connected)
+		("accepts", s_accepted)
+		("accepts_per_sec", s_accepted / elapsed);
+}
+
+int main(int argc, char* argv[])
+{
+	bench::options opt(argc, argv);
+	std::vector<int> threads = opt.get_list("threads", 1);
+	int clients = opt.get("clients", 4);
+	double seconds = opt.get("seconds", 2);
+
+	for(size_t i=0; i < threads.size(); ++i) {
+		run(threads[i], clients, seconds);
+	}
+	return 0;
+}
+
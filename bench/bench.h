@@ -0,0 +1,166 @@
+#ifndef BENCH_H__
+#define BENCH_H__
+
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+// Options are given as --name=value. Results are written to stdout as
+// one JSON object per line, so that runs can be collected and compared.
+
+namespace bench {
+
+
+static inline double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+class options {
+public:
+	options(int argc, char* argv[])
+	{
+		for(int i=1; i < argc; ++i) {
+			m_args.push_back(argv[i]);
+		}
+	}
+
+	double get(const char* name, double def) const
+	{
+		std::string prefix = std::string("--") + name + "=";
+		for(size_t i=0; i < m_args.size(); ++i) {
+			if(m_args[i].compare(0, prefix.size(), prefix) == 0) {
+				return atof(m_args[i].c_str() + prefix.size());
+			}
+		}
+		return def;
+	}
+
+	// comma separated list, such as --threads=1,2,4
+	std::vector<int> get_list(const char* name, int def) const
+	{
+		std::vector<int> result;
+		std::string prefix = std::string("--") + name + "=";
+		for(size_t i=0; i < m_args.size(); ++i) {
+			if(m_args[i].compare(0, prefix.size(), prefix) == 0) {
+				std::istringstream in(m_args[i].substr(prefix.size()));
+				std::string item;
+				while(std::getline(in, item, ',')) {
+					result.push_back(atoi(item.c_str()));
+				}
+			}
+		}
+		if(result.empty()) {
+			result.push_back(def);
+		}
+		return result;
+	}
+
+private:
+	std::vector<std::string> m_args;
+};
+
+// one line of JSON
+class result {
+public:
+	result(const char* name)
+	{
+		m_out.setf(std::ios::fixed);
+		m_out.precision(3);
+		m_out << "{\"bench\":\"" << name << "\"";
+	}
+
+	template <typename T>
+	result& operator() (const char* key, T value)
+	{
+		m_out << ",\"" << key << "\":" << value;
+		return *this;
+	}
+
+	result& operator() (const char* key, const char* value)
+	{
+		m_out << ",\"" << key << "\":\"" << value << "\"";
+		return *this;
+	}
+
+	~result()
+	{
+		std::cout << m_out.str() << "}" << std::endl;
+	}
+
+private:
+	std::ostringstream m_out;
+};
+
+static inline double percentile(std::vector<double>& samples, double p)
+{
+	if(samples.empty()) {
+		return 0;
+	}
+	std::sort(samples.begin(), samples.end());
+	size_t i = (size_t)(samples.size() * p / 100.0);
+	if(i >= samples.size()) {
+		i = samples.size() - 1;
+	}
+	return samples[i];
+}
+
+// listens on a free port of 127.0.0.1 and returns the address
+static inline struct sockaddr_in listen_loopback(mp::wavy::loop& lo,
+		mp::wavy::loop::listen_callback_t callback)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	int lsock = lo.listen(PF_INET, SOCK_STREAM, 0,
+			(struct sockaddr*)&addr, sizeof(addr), callback);
+
+	socklen_t len = sizeof(addr);
+	if(getsockname(lsock, (struct sockaddr*)&addr, &len) < 0) {
+		perror("getsockname");
+		exit(1);
+	}
+	return addr;
+}
+
+// blocking client socket
+static inline int connect_loopback(const struct sockaddr_in& addr)
+{
+	int fd = socket(PF_INET, SOCK_STREAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if(connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
+
+}  // namespace bench
+
+#endif /* bench.h */
+
@@ -0,0 +1,148 @@
+#include "bench.h"
+#include <mp/pthread.h>
+
+// Echo request/response over loopback TCP. Each client thread keeps one
+// request in flight on each of its connections and measures the time
+// until the whole response is read.
+//
+//   --threads=1,2,4  loop threads of the server
+//   --conns=64       connections
+//   --clients=4      client threads
+//   --size=64        request size in bytes
+//   --seconds=2      duration of a run
+
+class echo_handler : public mp::wavy::handler {
+public:
+	echo_handler(int fd, mp::wavy::loop* lo) :
+		mp::wavy::handler(fd), m_lo(lo) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[4096];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl < 0 && (errno == EINTR || errno == EAGAIN)) { return; }
+			e.remove();
+			return;
+		}
+		char* copy = (char*)malloc(rl);
+		memcpy(copy, buf, rl);
+		m_lo->write(fd(), copy, rl, &::free, copy);
+	}
+
+private:
+	mp::wavy::loop* m_lo;
+};
+
+static void accepted(mp::wavy::loop* lo, int fd, int err)
+{
+	if(fd < 0) {
+		return;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	lo->add_handler<echo_handler>(fd, lo);
+}
+
+struct client {
+	std::vector<int> fds;
+	size_t size;
+	double until;
+	std::vector<double> latencies;
+};
+
+static void client_main(client* c)
+{
+	std::vector<char> req(c->size, 'x');
+	std::vector<char> res(c->size);
+	std::vector<double> sent(c->fds.size());
+
+	while(bench::now() < c->until) {
+		for(size_t i=0; i < c->fds.size(); ++i) {
+			sent[i] = bench::now();
+			if(::write(c->fds[i], &req[0], c->size) != (ssize_t)c->size) {
+				perror("write");
+				exit(1);
+			}
+		}
+		for(size_t i=0; i < c->fds.size(); ++i) {
+			size_t got = 0;
+			while(got < c->size) {
+				ssize_t rl = ::read(c->fds[i], &res[got], c->size - got);
+				if(rl <= 0) {
+					perror("read");
+					exit(1);
+				}
+				got += rl;
+			}
+			c->latencies.push_back(bench::now() - sent[i]);
+		}
+	}
+}
+
+static void run(int threads, int conns, int clients, size_t size, double seconds)
+{
+	mp::wavy::loop lo;
+	using namespace mp::placeholders;
+	struct sockaddr_in addr = bench::listen_loopback(lo,
+			mp::bind(&accepted, &lo, _1, _2));
+	lo.start(threads);
+
+	std::vector<client> cs(clients);
+	for(int i=0; i < conns; ++i) {
+		cs[i % clients].fds.push_back(bench::connect_loopback(addr));
+	}
+
+	double start = bench::now();
+	std::vector<mp::pthread_thread> ths(clients);
+	for(int i=0; i < clients; ++i) {
+		cs[i].size = size;
+		cs[i].until = start + seconds;
+		ths[i].run(mp::bind(&client_main, &cs[i]));
+	}
+
+	std::vector<double> all;
+	for(int i=0; i < clients; ++i) {
+		ths[i].join();
+		all.insert(all.end(), cs[i].latencies.begin(), cs[i].latencies.end());
+	}
+	double elapsed = bench::now() - start;
+
+	for(int i=0; i < clients; ++i) {
+		for(size_t j=0; j < cs[i].fds.size(); ++j) {
+			::close(cs[i].fds[j]);
+		}
+	}
+	lo.end();
+	lo.join();
+
+	size_t requests = all.size();
+	bench::result("echo")
+		("threads", threads)
+		("conns", conns)
+		("size", size)
+		("requests", requests)
+		("rps", requests / elapsed)
+		("p50_us", bench::percentile(all, 50) * 1e6)
+		("p99_us", bench::percentile(all, 99) * 1e6)
+		("max_us", bench::percentile(all, 100) * 1e6);
+}
+
+int main(int argc, char* argv[])
+{
+	bench::options opt(argc, argv);
+	std::vector<int> threads = opt.get_list("threads", 1);
+	int conns = opt.get("conns", 64);
+	int clients = opt.get("clients", 4);
+	size_t size = opt.get("size", 64);
+	double seconds = opt.get("seconds", 2);
+
+	if(clients > conns) {
+		clients = conns;
+	}
+	for(size_t i=0; i < threads.size(); ++i) {
+		run(threads[i], conns, clients, size, seconds);
+	}
+	return 0;
+}
+
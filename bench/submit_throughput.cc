@@ -0,0 +1,93 @@
+#include "bench.h"
+#include <mp/pthread.h>
+
+// Tasks run per second when producer threads submit them one by one,
+// and in batches with submit_bulk.
+//
+//   --threads=1,2,4  loop threads
+//   --producers=4    submitting threads
+//   --tasks=1000000  total number of tasks
+//   --batch=64       tasks per submit_bulk
+
+static volatile int s_count = 0;
+
+static void task()
+{
+	__sync_add_and_fetch(&s_count, 1);
+}
+
+struct make_task {
+	mp::function<void ()> operator() (size_t) const
+	{
+		return &task;
+	}
+};
+
+struct producer {
+	mp::wavy::loop* lo;
+	int tasks;
+	int batch;  // 0 for submit
+};
+
+static void producer_main(producer* p)
+{
+	if(p->batch == 0) {
+		for(int i=0; i < p->tasks; ++i) {
+			p->lo->submit(&task);
+		}
+	} else {
+		for(int i=0; i < p->tasks; i += p->batch) {
+			int n = std::min(p->batch, p->tasks - i);
+			p->lo->submit_bulk(n, make_task());
+		}
+	}
+}
+
+static void run(const char* method, int threads, int producers, int tasks, int batch)
+{
+	mp::wavy::loop lo;
+	lo.start(threads);
+	s_count = 0;
+
+	double start = bench::now();
+	std::vector<producer> ps(producers);
+	std::vector<mp::pthread_thread> ths(producers);
+	for(int i=0; i < producers; ++i) {
+		ps[i].lo = &lo;
+		ps[i].tasks = tasks / producers;
+		ps[i].batch = batch;
+		ths[i].run(mp::bind(&producer_main, &ps[i]));
+	}
+	for(int i=0; i < producers; ++i) {
+		ths[i].join();
+	}
+	lo.flush();
+	double elapsed = bench::now() - start;
+
+	lo.end();
+	lo.join();
+
+	bench::result("submit")
+		("method", method)
+		("threads", threads)
+		("producers", producers)
+		("batch", batch)
+		("tasks", s_count)
+		("tasks_per_sec", s_count / elapsed);
+}
+
+int main(int argc, char* argv[])
+{
+	bench::options opt(argc, argv);
+	std::vector<int> threads = opt.get_list("threads", 1);
+	int producers = opt.get("producers", 4);
+	int tasks = opt.get("tasks", 1000000);
+	int batch = opt.get("batch", 64);
+
+	for(size_t i=0; i < threads.size(); ++i) {
+		run("submit", threads[i], producers, tasks, 0);
+		run("submit_bulk", threads[i], producers, tasks, batch);
+	}
+	return 0;
+}
+
@@ -0,0 +1,142 @@
+#include "bench.h"
+#include <mp/pthread.h>
+#include <sys/uio.h>
+
+// Throughput of loop::write, loop::writev and loop::sendfile over
+// loopback TCP. One connection per loop thread is written to in
+// round-robin order and drained by a reader thread each.
+//
+//   --threads=1,2,4  loop threads (and connections)
+//   --size=65536     bytes per call
+//   --mbytes=256     total megabytes per method
+
+static const size_t MAX_SIZE = 1024*1024;
+static char s_data[MAX_SIZE];
+
+static volatile int s_accepted_fd[64];
+static volatile int s_accepted = 0;
+
+static void accepted(int fd, int err)
+{
+	if(fd < 0) {
+		return;
+	}
+	int n = __sync_fetch_and_add(&s_accepted, 1);
+	s_accepted_fd[n] = fd;
+}
+
+struct reader {
+	int fd;
+	uint64_t expect;
+};
+
+static void reader_main(reader* r)
+{
+	std::vector<char> buf(256*1024);
+	uint64_t got = 0;
+	while(got < r->expect) {
+		ssize_t rl = ::read(r->fd, &buf[0], buf.size());
+		if(rl <= 0) {
+			perror("read");
+			exit(1);
+		}
+		got += rl;
+	}
+}
+
+static void run(const char* method, int threads, size_t size, uint64_t total, int infd)
+{
+	mp::wavy::loop lo;
+	s_accepted = 0;
+	struct sockaddr_in addr = bench::listen_loopback(lo, &accepted);
+	lo.start(threads);
+
+	std::vector<int> clients(threads);
+	for(int i=0; i < threads; ++i) {
+		clients[i] = bench::connect_loopback(addr);
+	}
+	while(s_accepted < threads) {
+		usleep(1000);
+	}
+
+	uint64_t calls = total / size;
+	std::vector<reader> rs(threads);
+	std::vector<mp::pthread_thread> ths(threads);
+	for(int i=0; i < threads; ++i) {
+		rs[i].fd = clients[i];
+		rs[i].expect = (calls / threads + (i < (int)(calls % threads) ? 1 : 0)) * size;
+		ths[i].run(mp::bind(&reader_main, &rs[i]));
+	}
+
+	struct iovec vec[2];
+	vec[0].iov_base = s_data;
+	vec[0].iov_len = size / 2;
+	vec[1].iov_base = s_data + size / 2;
+	vec[1].iov_len = size - size / 2;
+
+	double start = bench::now();
+	for(uint64_t c=0; c < calls; ++c) {
+		int fd = s_accepted_fd[c % threads];
+		if(strcmp(method, "writev") == 0) {
+			lo.writev(fd, vec, 2, NULL, NULL);
+		} else if(strcmp(method, "sendfile") == 0) {
+			lo.sendfile(fd, infd, 0, size, NULL, NULL);
+		} else {
+			lo.write(fd, s_data, size);
+		}
+	}
+	for(int i=0; i < threads; ++i) {
+		ths[i].join();
+	}
+	double elapsed = bench::now() - start;
+
+	lo.flush();
+	lo.end();
+	lo.join();
+	for(int i=0; i < threads; ++i) {
+		::close(clients[i]);
+		::close(s_accepted_fd[i]);
+	}
+
+	bench::result("write")
+		("method", method)
+		("threads", threads)
+		("size", size)
+		("bytes", calls * size)
+		("mbps", calls * size / elapsed / (1024*1024));
+}
+
+int main(int argc, char* argv[])
+{
+	bench::options opt(argc, argv);
+	std::vector<int> threads = opt.get_list("threads", 1);
+	size_t size = opt.get("size", 65536);
+	uint64_t total = (uint64_t)(opt.get("mbytes", 256) * 1024*1024);
+
+	if(size == 0 || size > MAX_SIZE) {
+		std::cerr << "size must be 1.." << MAX_SIZE << std::endl;
+		return 1;
+	}
+	memset(s_data, 'x', sizeof(s_data));
+
+	char path[] = "/tmp/mpio-bench-XXXXXX";
+	int infd = mkstemp(path);
+	if(infd < 0 || ::write(infd, s_data, size) != (ssize_t)size) {
+		perror("mkstemp");
+		return 1;
+	}
+	unlink(path);
+
+	const char* methods[] = {"write", "writev", "sendfile"};
+	for(size_t m=0; m < sizeof(methods)/sizeof(methods[0]); ++m) {
+		for(size_t i=0; i < threads.size(); ++i) {
+			if(threads[i] < 1 || threads[i] > 64) {
+				continue;
+			}
+			run(methods[m], threads[i], size, total, infd);
+		}
+	}
+	::close(infd);
+	return 0;
+}
+
@@ -0,0 +1,419 @@
+//
+// mpio future
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MP_FUTURE_H__
+#define MP_FUTURE_H__
+
+#include "mp/memory.h"
+#include "mp/pthread.h"
+#include "mp/task.h"
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <iterator>
+
+namespace mp {
+
+
+// Result of a computation which finishes on another thread. A promise
+// sets the value (or an error) once, and the future gets it. A value
+// and a continuation are handed over with compare-and-swap; a mutex is
+// taken only by the threads which block in wait().
+//
+// T must be default constructible and copyable.
+
+template <typename T>
+class future;
+
+template <typename T>
+class promise;
+
+namespace detail {
+
+
+template <typename T>
+class future_state {
+public:
+	future_state() :
+		m_state(STATE_EMPTY), m_satisfied(0), m_subscribed(0),
+		m_waiters(0), m_failed(false) { }
+
+	void set_value(const T& v)
+	{
+		satisfy();
+		m_value = v;
+		complete();
+	}
+
+	void set_error(const std::string& msg)
+	{
+		satisfy();
+		m_error = msg;
+		m_failed = true;
+		complete();
+	}
+
+	// the value is read after it is found ready
+	bool is_ready() const
+	{
+		if(m_state != STATE_READY) {
+			return false;
+		}
+		__sync_synchronize();
+		return true;
+	}
+
+	bool failed() const
+	{
+		return m_failed;
+	}
+
+	const T& value() const
+	{
+		return m_value;
+	}
+
+	const std::string& error() const
+	{
+		return m_error;
+	}
+
+	// don't call it on the only thread which can complete it
+	void wait()
+	{
+		if(is_ready()) {
+			return;
+		}
+		pthread_scoped_lock lk(m_mutex);
+		__sync_add_and_fetch(&m_waiters, 1);
+		while(!is_ready()) {
+			m_cond.wait(m_mutex);
+		}
+		__sync_sub_and_fetch(&m_waiters, 1);
+	}
+
+	// runs cont when it is completed: right now if it is already,
+	// otherwise on the thread which completes it.
+	void on_ready(task& cont)
+	{
+		if(!__sync_bool_compare_and_swap(&m_subscribed, 0, 1)) {
+			throw std::logic_error("future already has a continuation");
+		}
+		if(is_ready()) {
+			cont();
+			return;
+		}
+		m_cont.swap(cont);
+		if(!__sync_bool_compare_and_swap(&m_state,
+					STATE_EMPTY, STATE_CONTINUATION)) {
+			run_continuation();  // completed in between
+		}
+	}
+
+private:
+	void satisfy()
+	{
+		if(!__sync_bool_compare_and_swap(&m_satisfied, 0, 1)) {
+			throw std::logic_error("promise already satisfied");
+		}
+	}
+
+	void complete()
+	{
+		int prev = __sync_val_compare_and_swap(&m_state,
+				STATE_EMPTY, STATE_READY);
+		if(prev == STATE_CONTINUATION) {
+			m_state = STATE_READY;
+			__sync_synchronize();
+		}
+
+		if(m_waiters > 0) {
+			pthread_scoped_lock lk(m_mutex);
+			m_cond.broadcast();
+		}
+
+		if(prev == STATE_CONTINUATION) {
+			run_continuation();
+		}
+	}
+
+	void run_continuation()
+	{
+		task cont;
+		cont.swap(m_cont);
+		cont();
+	}
+
+private:
+	enum {
+		STATE_EMPTY,
+		STATE_CONTINUATION,
+		STATE_READY,
+	};
+	volatile int m_state;
+	volatile int m_satisfied;
+	volatile int m_subscribed;
+	volatile int m_waiters;
+
+	T m_value;
+	std::string m_error;
+	bool m_failed;
+
+	task m_cont;
+
+	pthread_mutex m_mutex;
+	pthread_cond m_cond;
+
+private:
+	future_state(const future_state&);
+};
+
+
+template <typename T, typename R, typename F>
+struct then_call {
+	then_call(future_state<T>* from, shared_ptr<future_state<R> > to, F f) :
+		from(from), to(to), f(f) { }
+
+	future_state<T>* from;  // runs this
+	shared_ptr<future_state<R> > to;
+	F f;
+
+	void operator() ()
+	{
+		if(from->failed()) {
+			to->set_error(from->error());
+			return;
+		}
+		R result;
+		try {
+			result = f(from->value());
+		} catch (std::exception& e) {
+			to->set_error(e.what());
+			return;
+		} catch (...) {
+			to->set_error("unknown error");
+			return;
+		}
+		to->set_value(result);
+	}
+};
+
+
+template <typename T>
+struct when_all_state {
+	when_all_state(size_t num) :
+		values(num), remaining(num), failed(0),
+		to(new future_state<std::vector<T> >()) { }
+
+	std::vector<T> values;
+	volatile size_t remaining;
+	volatile int failed;
+	std::string error;  // of the first one failed
+	shared_ptr<future_state<std::vector<T> > > to;
+};
+
+template <typename T>
+struct when_all_call {
+	when_all_call(shared_ptr<when_all_state<T> > all,
+			future_state<T>* from, size_t index) :
+		all(all), from(from), index(index) { }
+
+	shared_ptr<when_all_state<T> > all;
+	future_state<T>* from;  // runs this
+	size_t index;
+
+	void operator() ()
+	{
+		if(from->failed()) {
+			if(__sync_bool_compare_and_swap(&all->failed, 0, 1)) {
+				all->error = from->error();
+			}
+		} else {
+			all->values[index] = from->value();
+		}
+		if(__sync_sub_and_fetch(&all->remaining, 1) == 0) {
+			if(all->failed) {
+				all->to->set_error(all->error);
+			} else {
+				all->to->set_value(all->values);
+			}
+		}
+	}
+};
+
+
+struct future_access {
+	template <typename T>
+	static future_state<T>* state(const future<T>& f)
+	{
+		return f.m_state.get();
+	}
+
+	template <typename T>
+	static future<T> make(shared_ptr<future_state<T> > s)
+	{
+		return future<T>(s);
+	}
+};
+
+
+}  // namespace detail
+
+
+template <typename T>
+class future {
+public:
+	typedef T value_type;
+
+	future() { }
+
+	bool valid() const
+	{
+		return m_state.get() != NULL;
+	}
+
+	bool is_ready() const
+	{
+		return m_state->is_ready();
+	}
+
+	// blocks until it is ready. throws std::runtime_error if the
+	// promise is set an error.
+	T get() const
+	{
+		m_state->wait();
+		if(m_state->failed()) {
+			throw std::runtime_error(m_state->error());
+		}
+		return m_state->value();
+	}
+
+	void wait() const
+	{
+		m_state->wait();
+	}
+
+	// Returns the future of f(value). f runs on the thread which
+	// completes this future, or on this thread if it is already
+	// completed. An error skips f and is passed to the returned future.
+	// A future can have one continuation.
+	template <typename R, typename F>
+	future<R> then(F f) const
+	{
+		shared_ptr<detail::future_state<R> > to(new detail::future_state<R>());
+		task cont(detail::then_call<T, R, F>(m_state.get(), to, f));
+		m_state->on_ready(cont);
+		return future<R>(to);
+	}
+
+private:
+	explicit future(shared_ptr<detail::future_state<T> > s) : m_state(s) { }
+
+	shared_ptr<detail::future_state<T> > m_state;
+
+	template <typename U> friend class future;
+	friend class promise<T>;
+	friend struct detail::future_access;
+};
+
+
+template <typename T>
+class promise {
+public:
+	promise() : m_state(new detail::future_state<T>()) { }
+
+	future<T> get_future() const
+	{
+		return future<T>(m_state);
+	}
+
+	// each promise is set once
+	void set_value(const T& v)
+	{
+		m_state->set_value(v);
+	}
+
+	void set_error(const std::string& msg)
+	{
+		m_state->set_error(msg);
+	}
+
+private:
+	shared_ptr<detail::future_state<T> > m_state;
+};
+
+
+// Future of the values of the futures in [first, last), in order.
+// It fails with the error of the first one failed, after all of them
+// are completed.
+template <typename Iterator>
+future<std::vector<typename std::iterator_traits<Iterator>::value_type::value_type> >
+when_all(Iterator first, Iterator last)
+{
+	typedef typename std::iterator_traits<Iterator>::value_type::value_type T;
+
+	shared_ptr<detail::when_all_state<T> > all(
+			new detail::when_all_state<T>(std::distance(first, last)));
+	future<std::vector<T> > result(detail::future_access::make(all->to));
+
+	if(first == last) {
+		all->to->set_value(std::vector<T>());
+		return result;
+	}
+
+	for(size_t i=0; first != last; ++first, ++i) {
+		detail::future_state<T>* from = detail::future_access::state(*first);
+		task cont(detail::when_all_call<T>(all, from, i));
+		from->on_ready(cont);
+	}
+	return result;
+}
+
+
+namespace detail {
+
+// runs f() and sets the result to the promise
+template <typename R, typename F>
+struct promise_call {
+	promise_call(promise<R> p, F f) : p(p), f(f) { }
+
+	promise<R> p;
+	F f;
+
+	void operator() ()
+	{
+		R result;
+		try {
+			result = f();
+		} catch (std::exception& e) {
+			p.set_error(e.what());
+			return;
+		} catch (...) {
+			p.set_error("unknown error");
+			return;
+		}
+		p.set_value(result);
+	}
+};
+
+}  // namespace detail
+
+
+}  // namespace mp
+
+#endif /* mp/future.h */
+
@@ -0,0 +1,218 @@
+//
+// mpio task
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MP_TASK_H__
+#define MP_TASK_H__
+
+#include <new>
+#include <stddef.h>
+#if __cplusplus >= 201103L
+#include <utility>
+#endif
+
+#ifndef MP_TASK_INLINE_SIZE
+#define MP_TASK_INLINE_SIZE 48
+#endif
+
+namespace mp {
+
+
+// Callable of void () which stores a function object of up to
+// MP_TASK_INLINE_SIZE bytes in itself, instead of on the heap.
+// Tasks are handed over with swap(), which never allocates memory.
+// Copying a task copies the function object.
+class task {
+public:
+	task() : m_ops(NULL) { }
+
+	template <typename F>
+	task(F f) : m_ops(NULL)
+	{
+		typedef holder<F, (sizeof(F) <= sizeof(storage) &&
+				__alignof__(F) <= __alignof__(storage))> holder_t;
+		holder_t::construct(&m_storage, f);
+		m_ops = &holder_t::table;
+	}
+
+	task(const task& o) : m_ops(NULL)
+	{
+		if(o.m_ops) {
+			o.m_ops->clone(&o.m_storage, &m_storage);
+			m_ops = o.m_ops;
+		}
+	}
+
+#if __cplusplus >= 201103L
+	task(task&& o) : m_ops(NULL)
+	{
+		take(o);
+	}
+
+	task& operator= (task&& o)
+	{
+		if(this != &o) {
+			reset();
+			take(o);
+		}
+		return *this;
+	}
+#endif
+
+	~task()
+	{
+		reset();
+	}
+
+	task& operator= (const task& o)
+	{
+		task tmp(o);
+		swap(tmp);
+		return *this;
+	}
+
+	// an empty task does nothing
+	void operator() ()
+	{
+		if(m_ops) {
+			m_ops->call(&m_storage);
+		}
+	}
+
+	bool empty() const
+	{
+		return m_ops == NULL;
+	}
+
+	void reset()
+	{
+		if(m_ops) {
+			m_ops->destroy(&m_storage);
+			m_ops = NULL;
+		}
+	}
+
+	void swap(task& o)
+	{
+		if(this == &o) {
+			return;
+		}
+		task tmp;
+		tmp.take(*this);
+		take(o);
+		o.take(tmp);
+	}
+
+private:
+	union storage {
+		char buf[MP_TASK_INLINE_SIZE];
+		void* ptr;
+		long long ll;
+		long double ld;
+		void (*fp)();
+	};
+
+	struct ops {
+		void (*call)(storage* s);
+		void (*relocate)(storage* from, storage* to);
+		void (*clone)(const storage* from, storage* to);
+		void (*destroy)(storage* s);
+	};
+
+	template <typename F, bool Inline>
+	struct holder;
+
+	template <typename F>
+	struct holder<F, true> {
+		static F* get(storage* s) { return reinterpret_cast<F*>(s->buf); }
+
+		static void construct(storage* s, F& f) { new (s->buf) F(f); }
+
+		static void call(storage* s) { (*get(s))(); }
+
+		static void relocate(storage* from, storage* to)
+		{
+#if __cplusplus >= 201103L
+			new (to->buf) F(std::move(*get(from)));
+#else
+			new (to->buf) F(*get(from));
+#endif
+			get(from)->~F();
+		}
+
+		static void clone(const storage* from, storage* to)
+			{ new (to->buf) F(*get(const_cast<storage*>(from))); }
+
+		static void destroy(storage* s) { get(s)->~F(); }
+
+		static const ops table;
+	};
+
+	template <typename F>
+	struct holder<F, false> {
+		static F* get(storage* s) { return reinterpret_cast<F*>(s->ptr); }
+
+		static void construct(storage* s, F& f) { s->ptr = new F(f); }
+
+		static void call(storage* s) { (*get(s))(); }
+
+		static void relocate(storage* from, storage* to)
+			{ to->ptr = from->ptr; }
+
+		static void clone(const storage* from, storage* to)
+			{ to->ptr = new F(*get(const_cast<storage*>(from))); }
+
+		static void destroy(storage* s) { delete get(s); }
+
+		static const ops table;
+	};
+
+	// *this must be empty. leaves o empty.
+	void take(task& o)
+	{
+		if(o.m_ops) {
+			o.m_ops->relocate(&o.m_storage, &m_storage);
+			m_ops = o.m_ops;
+			o.m_ops = NULL;
+		}
+	}
+
+private:
+	storage m_storage;
+	const ops* m_ops;
+};
+
+template <typename F>
+const task::ops task::holder<F, true>::table = {
+	&task::holder<F, true>::call,
+	&task::holder<F, true>::relocate,
+	&task::holder<F, true>::clone,
+	&task::holder<F, true>::destroy,
+};
+
+template <typename F>
+const task::ops task::holder<F, false>::table = {
+	&task::holder<F, false>::call,
+	&task::holder<F, false>::relocate,
+	&task::holder<F, false>::clone,
+	&task::holder<F, false>::destroy,
+};
+
+
+}  // namespace mp
+
+#endif /* mp/task.h */
+
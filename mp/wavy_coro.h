@@ -0,0 +1,465 @@
+//
+// mpio wavy coroutines
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MP_WAVY_CORO_H__
+#define MP_WAVY_CORO_H__
+
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "mp/wavy_coro.h requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include "mp/wavy.h"
+#include "mp/exception.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace mp {
+namespace wavy {
+namespace coro {
+
+
+// Awaitables bound to a loop. A coroutine waiting for an event is
+// resumed by the handler of the event, on the worker thread which
+// dispatched it, so that no thread is switched to resume it.
+//
+//   coro::task<void> session(loop& lo, int fd) {
+//       co_await coro::readable(lo, fd);
+//       ...
+//       co_await coro::write(lo, fd, buf, len);
+//   }
+//   coro::spawn(lo, session(lo, fd));
+
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+
+struct starter {
+	std::coroutine_handle<> handle;
+	void operator() () { handle.resume(); }
+};
+
+
+// Resumes the coroutine when both the event has come and
+// await_suspend() has returned, whichever is last. An event which
+// comes before await_suspend() returns lets it continue without
+// suspending.
+class completion {
+public:
+	completion() : m_state(STATE_INIT) { }
+
+	// call after the operation is started
+	bool suspend()
+	{
+		return __sync_bool_compare_and_swap(&m_state,
+				STATE_INIT, STATE_SUSPENDED);
+	}
+
+	void complete()
+	{
+		std::coroutine_handle<> h = m_handle;
+		if(!__sync_bool_compare_and_swap(&m_state,
+					STATE_INIT, STATE_COMPLETED)) {
+			h.resume();
+		}
+	}
+
+	// resumes it on a task of the loop instead, for the callers
+	// which hold a lock that the coroutine may take
+	void complete_later(loop& lo)
+	{
+		std::coroutine_handle<> h = m_handle;
+		if(!__sync_bool_compare_and_swap(&m_state,
+					STATE_INIT, STATE_COMPLETED)) {
+			starter s = { h };
+			lo.submit(s);
+		}
+	}
+
+	// call before the operation is started
+	void set_handle(std::coroutine_handle<> h)
+	{
+		m_handle = h;
+	}
+
+private:
+	enum {
+		STATE_INIT,
+		STATE_SUSPENDED,
+		STATE_COMPLETED,
+	};
+	volatile int m_state;
+	std::coroutine_handle<> m_handle;
+
+	completion(const completion&) = delete;
+};
+
+
+// one-shot handler which removes itself from the loop and
+// resumes the coroutine
+class fd_handler : public basic_handler {
+public:
+	fd_handler(int fd, completion* c, bool write) :
+		basic_handler(fd, this), m_completion(c)
+	{
+		set_write_event(write);
+	}
+
+	bool operator() (event& e)
+	{
+		completion* c = m_completion;
+		e.remove();
+		c->complete();
+		return false;
+	}
+
+private:
+	completion* m_completion;
+};
+
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+	bool detached = false;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			promise_base& p = h.promise();
+			if(p.continuation) {
+				return p.continuation;
+			}
+			if(p.detached) {
+				h.destroy();
+			}
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept { }
+	};
+
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception()
+	{
+		error = std::current_exception();
+	}
+
+	void rethrow()
+	{
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+template <typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	template <typename U>
+	void return_value(U&& v)
+	{
+		value.emplace(std::forward<U>(v));
+	}
+
+	T result()
+	{
+		rethrow();
+		return std::move(*value);
+	}
+};
+
+template <>
+struct promise<void> : promise_base {
+	void return_void() { }
+
+	void result()
+	{
+		rethrow();
+	}
+};
+
+}  // namespace detail
+
+
+// Lazily started coroutine. It runs when it is awaited, or when it is
+// passed to spawn().
+template <typename T>
+class task {
+public:
+	struct promise_type : detail::promise<T> {
+		task get_return_object()
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+	};
+
+	task(task&& o) noexcept : m_handle(o.m_handle)
+	{
+		o.m_handle = nullptr;
+	}
+
+	task& operator= (task&& o) noexcept
+	{
+		if(this != &o) {
+			if(m_handle) { m_handle.destroy(); }
+			m_handle = o.m_handle;
+			o.m_handle = nullptr;
+		}
+		return *this;
+	}
+
+	~task()
+	{
+		if(m_handle) {
+			m_handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		m_handle.promise().continuation = caller;
+		return m_handle;
+	}
+
+	T await_resume()
+	{
+		return m_handle.promise().result();
+	}
+
+	// the frame destroys itself when the coroutine finishes
+	std::coroutine_handle<> release_detached()
+	{
+		std::coroutine_handle<promise_type> h = m_handle;
+		m_handle = nullptr;
+		h.promise().detached = true;
+		return h;
+	}
+
+private:
+	explicit task(std::coroutine_handle<promise_type> h) : m_handle(h) { }
+
+	std::coroutine_handle<promise_type> m_handle;
+
+	task(const task&) = delete;
+	task& operator= (const task&) = delete;
+};
+
+
+// Starts the coroutine on a worker thread of the loop. An exception
+// which leaves the coroutine is ignored, like the one of a task.
+inline void spawn(loop& lo, task<void> t)
+{
+	detail::starter s = { t.release_detached() };
+	lo.submit(s);
+}
+
+
+// Waits until the fd is readable (or writable). The fd must not have
+// another handler in the loop while it is waited.
+class fd_awaiter {
+public:
+	fd_awaiter(loop& lo, int fd, bool write) :
+		m_loop(lo), m_fd(fd), m_write(write) { }
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		m_completion.set_handle(h);
+		m_loop.add_handler<detail::fd_handler>(m_fd, &m_completion, m_write);
+		return m_completion.suspend();
+	}
+
+	void await_resume() const { }
+
+private:
+	loop& m_loop;
+	int m_fd;
+	bool m_write;
+	detail::completion m_completion;
+};
+
+inline fd_awaiter readable(loop& lo, int fd)
+{
+	return fd_awaiter(lo, fd, false);
+}
+
+inline fd_awaiter writable(loop& lo, int fd)
+{
+	return fd_awaiter(lo, fd, true);
+}
+
+
+// Waits for sec seconds on a timer of the loop.
+class sleep_awaiter {
+public:
+	sleep_awaiter(loop& lo, double sec) : m_loop(lo), m_sec(sec) { }
+
+	bool await_ready() const { return m_sec <= 0.0; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		m_completion.set_handle(h);
+		// a timer of zero is disarmed
+		double sec = (m_sec < 1e-6) ? 1e-6 : m_sec;
+		m_loop.add_timer(sec, 0.0, callback(&m_completion));
+		return m_completion.suspend();
+	}
+
+	void await_resume() const { }
+
+private:
+	struct callback {
+		explicit callback(detail::completion* c) : completion(c) { }
+		detail::completion* completion;
+		bool operator() () { completion->complete(); return false; }
+	};
+
+	loop& m_loop;
+	double m_sec;
+	detail::completion m_completion;
+};
+
+inline sleep_awaiter sleep(loop& lo, double sec)
+{
+	return sleep_awaiter(lo, sec);
+}
+
+
+// Connects a socket with loop::connect() and returns the fd.
+// Throws system_error if it failed.
+class connect_awaiter {
+public:
+	connect_awaiter(loop& lo,
+			int socket_family, int socket_type, int protocol,
+			const sockaddr* addr, socklen_t addrlen, double timeout_sec) :
+		m_loop(lo), m_socket_family(socket_family),
+		m_socket_type(socket_type), m_protocol(protocol),
+		m_addr(addr), m_addrlen(addrlen), m_timeout_sec(timeout_sec),
+		m_fd(-1), m_err(0) { }
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		m_completion.set_handle(h);
+		m_loop.connect(m_socket_family, m_socket_type, m_protocol,
+				m_addr, m_addrlen, m_timeout_sec, callback(this));
+		return m_completion.suspend();
+	}
+
+	int await_resume() const
+	{
+		if(m_fd < 0) {
+			throw system_error(m_err, "connect failed");
+		}
+		return m_fd;
+	}
+
+private:
+	struct callback {
+		explicit callback(connect_awaiter* a) : self(a) { }
+		connect_awaiter* self;
+		void operator() (int fd, int err)
+		{
+			self->m_fd = fd;
+			self->m_err = err;
+			self->m_completion.complete();
+		}
+	};
+
+	loop& m_loop;
+	int m_socket_family;
+	int m_socket_type;
+	int m_protocol;
+	const sockaddr* m_addr;  // copied by loop::connect()
+	socklen_t m_addrlen;
+	double m_timeout_sec;
+	int m_fd;
+	int m_err;
+	detail::completion m_completion;
+};
+
+inline connect_awaiter connect(loop& lo,
+		int socket_family, int socket_type, int protocol,
+		const sockaddr* addr, socklen_t addrlen, double timeout_sec)
+{
+	return connect_awaiter(lo, socket_family, socket_type, protocol,
+			addr, addrlen, timeout_sec);
+}
+
+
+// Writes with loop::write() and waits until the buffer is released,
+// after it is written or dropped because of an error. The buffer
+// must live until then.
+class write_awaiter {
+public:
+	write_awaiter(loop& lo, int fd, const void* buf, size_t size) :
+		m_loop(lo), m_fd(fd), m_buf(buf), m_size(size) { }
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		m_completion.set_handle(h);
+		m_loop.write(m_fd, m_buf, m_size, &finalize, this);
+		return m_completion.suspend();
+	}
+
+	void await_resume() const { }
+
+private:
+	// runs with the write queue of the fd locked
+	static void finalize(void* user)
+	{
+		write_awaiter* self = static_cast<write_awaiter*>(user);
+		self->m_completion.complete_later(self->m_loop);
+	}
+
+	loop& m_loop;
+	int m_fd;
+	const void* m_buf;
+	size_t m_size;
+	detail::completion m_completion;
+};
+
+inline write_awaiter write(loop& lo, int fd, const void* buf, size_t size)
+{
+	return write_awaiter(lo, fd, buf, size);
+}
+
+
+}  // namespace coro
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* mp/wavy_coro.h */
+
@@ -0,0 +1,53 @@
+//
+// mpio wavy atomic
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef WAVY_ATOMIC_H__
+#define WAVY_ATOMIC_H__
+
+// gcc >= 4.7 provides __atomic_* builtins with explicit memory ordering.
+// older compilers fall back to full barriers with __sync_synchronize.
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define MP_WAVY_LOAD_ACQUIRE(p) \
+	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define MP_WAVY_STORE_RELEASE(p, v) \
+	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define MP_WAVY_FENCE() \
+	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define MP_WAVY_LOAD_ACQUIRE(p) \
+	({ __typeof__(*(p)) v_ = *(volatile __typeof__(*(p))*)(p); __sync_synchronize(); v_; })
+#define MP_WAVY_STORE_RELEASE(p, v) \
+	do { __sync_synchronize(); *(volatile __typeof__(*(p))*)(p) = (v); } while(0)
+#define MP_WAVY_FENCE() \
+	__sync_synchronize()
+#endif
+
+// hint for spin-wait loops
+#if defined(__i386__) || defined(__x86_64__)
+#define MP_WAVY_CPU_RELAX() \
+	__asm__ __volatile__("pause" ::: "memory")
+#else
+#define MP_WAVY_CPU_RELAX() \
+	__asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifndef MP_WAVY_CACHELINE_SIZE
+#define MP_WAVY_CACHELINE_SIZE 64
+#endif
+
+#endif /* wavy_atomic.h */
+
@@ -0,0 +1,176 @@
+//
+// mpio wavy cpu
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef WAVY_CPU_H__
+#define WAVY_CPU_H__
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <set>
+
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+
+namespace mp {
+namespace wavy {
+namespace {
+
+
+// parses a cpulist of sysfs, such as "0-3,8,10-11"
+static bool parse_cpulist(const char* str, std::vector<int>* result)
+{
+	const char* p = str;
+	while(*p != '\0' && *p != '\n') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		if(end == p) { return false; }
+		long last = first;
+		p = end;
+		if(*p == '-') {
+			++p;
+			last = strtol(p, &end, 10);
+			if(end == p) { return false; }
+			p = end;
+		}
+		for(long c=first; c <= last; ++c) {
+			result->push_back((int)c);
+		}
+		if(*p == ',') { ++p; }
+	}
+	return true;
+}
+
+static bool read_cpulist(const char* path, std::vector<int>* result)
+{
+	FILE* f = fopen(path, "r");
+	if(!f) {
+		return false;
+	}
+	char buf[4096];
+	bool ok = fgets(buf, sizeof(buf), f) != NULL &&
+		parse_cpulist(buf, result);
+	fclose(f);
+	return ok;
+}
+
+// CPUs this process is allowed to run on
+static void allowed_cpus(std::vector<int>* result)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for(int c=0; c < CPU_SETSIZE; ++c) {
+			if(CPU_ISSET(c, &set)) {
+				result->push_back(c);
+			}
+		}
+		return;
+	}
+#endif
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	for(long c=0; c < n; ++c) {
+		result->push_back((int)c);
+	}
+}
+
+// first hardware thread of each core. if node >= 0, only the cores
+// of that NUMA node. falls back to all allowed CPUs without sysfs.
+static void core_cpus(int node, std::vector<int>* result)
+{
+	std::vector<int> cpus;
+	allowed_cpus(&cpus);
+
+	if(node >= 0) {
+		char path[128];
+		snprintf(path, sizeof(path),
+				"/sys/devices/system/node/node%d/cpulist", node);
+		std::vector<int> local;
+		if(read_cpulist(path, &local)) {
+			std::set<int> on_node(local.begin(), local.end());
+			std::vector<int> filtered;
+			for(size_t i=0; i < cpus.size(); ++i) {
+				if(on_node.count(cpus[i])) {
+					filtered.push_back(cpus[i]);
+				}
+			}
+			cpus.swap(filtered);
+		}
+	}
+
+	std::set<int> seen;  // siblings of the cores already taken
+	for(size_t i=0; i < cpus.size(); ++i) {
+		int c = cpus[i];
+		if(seen.count(c)) {
+			continue;
+		}
+		result->push_back(c);
+
+		char path[128];
+		snprintf(path, sizeof(path),
+				"/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+		std::vector<int> siblings;
+		if(read_cpulist(path, &siblings)) {
+			seen.insert(siblings.begin(), siblings.end());
+		}
+	}
+}
+
+// returns 0 or an errno value
+static int pin_thread(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	return ENOSYS;
+#endif
+}
+
+static void name_thread(const char* name)
+{
+#if defined(__linux__) && defined(__GLIBC__) && \
+	(__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 12))
+	char buf[16];  // including NUL
+	strncpy(buf, name, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+	pthread_setname_np(pthread_self(), buf);
+#elif defined(__APPLE__) && defined(__MACH__)
+	pthread_setname_np(name);
+#elif defined(__FreeBSD__)
+	pthread_set_name_np(pthread_self(), name);
+#else
+	(void)name;
+#endif
+}
+
+
+}  // noname namespace
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_cpu.h */
+
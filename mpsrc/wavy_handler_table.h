@@ -0,0 +1,266 @@
+//
+// mpio wavy handler table
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef WAVY_HANDLER_TABLE_H__
+#define WAVY_HANDLER_TABLE_H__
+
+#include "mp/wavy.h"
+#include "mp/pthread.h"
+#include "wavy_atomic.h"
+#include <sched.h>
+#include <vector>
+#include <utility>
+
+#ifndef MP_WAVY_EPOCH_EXTERNAL_SLOTS
+#define MP_WAVY_EPOCH_EXTERNAL_SLOTS 16
+#endif
+
+namespace mp {
+namespace wavy {
+namespace {
+
+
+// fd-indexed table of handlers read without locks or reference counting.
+//
+// Each registered handler is wrapped in an immutable entry. Replacing or
+// removing a handler swaps the entry pointer, so the pointer identifies
+// one generation of the fd and a stale dispatch can not reset a newer one.
+// Unlinked entries are reclaimed with epoch-based reclamation: a reader
+// pins the current epoch in its slot while it uses an entry, and an entry
+// retired at epoch e is freed once the global epoch reaches e+2.
+class handler_table {
+public:
+	typedef shared_ptr<basic_handler> shared_handler;
+
+	struct entry {
+		entry(shared_handler h) : handler(h) { }
+		shared_handler handler;
+	};
+
+	struct slot {
+		slot() : epoch(0), depth(0), used(0) { }
+		volatile unsigned long epoch;  // 0 while quiescent
+		unsigned int depth;
+		volatile int used;
+		char pad[MP_WAVY_CACHELINE_SIZE
+			- sizeof(unsigned long) - 2*sizeof(int)];
+	};
+
+	handler_table(size_t size, size_t workers) :
+		m_entries(new entry*[size]()),
+		m_size(size),
+		m_slots(new slot[MP_WAVY_EPOCH_EXTERNAL_SLOTS + workers]),
+		m_nslots(MP_WAVY_EPOCH_EXTERNAL_SLOTS),
+		m_epoch(1),
+		m_nretired(0) { }
+
+	~handler_table()
+	{
+		for(size_t i=0; i < m_size; ++i) {
+			delete m_entries[i];
+		}
+		for(retired_t::iterator it(m_retired.begin());
+				it != m_retired.end(); ++it) {
+			delete it->second;
+		}
+		delete[] m_entries;
+		delete[] m_slots;
+	}
+
+	// slot owned by the worker thread. called before the worker starts.
+	slot* worker_slot(size_t index)
+	{
+		size_t n = MP_WAVY_EPOCH_EXTERNAL_SLOTS + index + 1;
+		if(m_nslots < n) {
+			MP_WAVY_STORE_RELEASE(&m_nslots, n);
+		}
+		return &m_slots[n - 1];
+	}
+
+	// slot borrowed by another thread, such as a caller of run_once()
+	slot* acquire_slot()
+	{
+		while(true) {
+			for(size_t i=0; i < MP_WAVY_EPOCH_EXTERNAL_SLOTS; ++i) {
+				if(m_slots[i].used == 0 &&
+						__sync_bool_compare_and_swap(&m_slots[i].used, 0, 1)) {
+					return &m_slots[i];
+				}
+			}
+			sched_yield();
+		}
+	}
+
+	void release_slot(slot* s)
+	{
+		MP_WAVY_STORE_RELEASE(&s->used, 0);
+	}
+
+	void enter(slot* s)
+	{
+		if(s->depth++ > 0) {
+			return;
+		}
+		while(true) {
+			unsigned long e = MP_WAVY_LOAD_ACQUIRE(&m_epoch);
+			s->epoch = e;
+			MP_WAVY_FENCE();
+			if(MP_WAVY_LOAD_ACQUIRE(&m_epoch) == e) {
+				return;
+			}
+		}
+	}
+
+	void leave(slot* s)
+	{
+		if(--s->depth > 0) {
+			return;
+		}
+		MP_WAVY_STORE_RELEASE(&s->epoch, 0UL);
+	}
+
+	// the caller must be between enter() and leave()
+	entry* get(int ident) const
+	{
+		return MP_WAVY_LOAD_ACQUIRE(&m_entries[ident]);
+	}
+
+	void set(shared_handler sh)
+	{
+		entry* e = new entry(sh);
+		pthread_scoped_lock lk(m_mutex);
+		entry* old = m_entries[sh->ident()];
+		MP_WAVY_STORE_RELEASE(&m_entries[sh->ident()], e);
+		retire(old);
+	}
+
+	void reset(int ident)
+	{
+		pthread_scoped_lock lk(m_mutex);
+		entry* old = m_entries[ident];
+		MP_WAVY_STORE_RELEASE(&m_entries[ident], (entry*)NULL);
+		retire(old);
+	}
+
+	// resets only if the handler is still the given generation
+	bool reset(int ident, entry* expect)
+	{
+		pthread_scoped_lock lk(m_mutex);
+		if(m_entries[ident] != expect) {
+			return false;
+		}
+		MP_WAVY_STORE_RELEASE(&m_entries[ident], (entry*)NULL);
+		retire(expect);
+		return true;
+	}
+
+	bool has_retired() const
+	{
+		return m_nretired != 0;
+	}
+
+	// frees the entries no reader can see any more.
+	// returns immediately if another thread is updating the table.
+	void reclaim()
+	{
+		if(!m_mutex.trylock()) {
+			return;
+		}
+
+		std::vector<entry*> garbage;
+		try {
+			// advances twice at most: an entry retired at the
+			// current epoch can be freed if no reader is pinned
+			unsigned long e = try_advance();
+			if(!m_retired.empty() && m_retired.back().first + 2 > e) {
+				e = try_advance();
+			}
+
+			retired_t::iterator it(m_retired.begin());
+			while(it != m_retired.end() && it->first + 2 <= e) {
+				garbage.push_back(it->second);
+				++it;
+			}
+			m_retired.erase(m_retired.begin(), it);
+			m_nretired = m_retired.size();
+		} catch (...) {
+			m_mutex.unlock();
+			throw;
+		}
+		m_mutex.unlock();
+
+		// handlers may close their fd in the destructor
+		for(std::vector<entry*>::iterator it(garbage.begin());
+				it != garbage.end(); ++it) {
+			delete *it;
+		}
+	}
+
+private:
+	void retire(entry* e)
+	{
+		if(!e) {
+			return;
+		}
+		MP_WAVY_FENCE();
+		m_retired.push_back( std::make_pair(
+					MP_WAVY_LOAD_ACQUIRE(&m_epoch), e) );
+		m_nretired = m_retired.size();
+	}
+
+	unsigned long try_advance()
+	{
+		unsigned long e = MP_WAVY_LOAD_ACQUIRE(&m_epoch);
+		MP_WAVY_FENCE();
+		size_t nslots = MP_WAVY_LOAD_ACQUIRE(&m_nslots);
+		for(size_t i=0; i < nslots; ++i) {
+			unsigned long se = MP_WAVY_LOAD_ACQUIRE(&m_slots[i].epoch);
+			if(se != 0 && se != e) {
+				return e;
+			}
+		}
+		MP_WAVY_STORE_RELEASE(&m_epoch, e+1);
+		return e+1;
+	}
+
+private:
+	entry** m_entries;
+	size_t m_size;
+
+	slot* m_slots;
+	volatile size_t m_nslots;
+
+	char m_pad0[MP_WAVY_CACHELINE_SIZE];
+	volatile unsigned long m_epoch;
+	char m_pad1[MP_WAVY_CACHELINE_SIZE];
+
+	pthread_mutex m_mutex;
+	typedef std::vector< std::pair<unsigned long, entry*> > retired_t;
+	retired_t m_retired;  // ordered by epoch
+	volatile size_t m_nretired;
+
+private:
+	handler_table(const handler_table&);
+};
+
+
+}  // noname namespace
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_handler_table.h */
+
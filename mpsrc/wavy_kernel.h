@@ -20,6 +20,7 @@
 
 #include "pp.h"
 
+// io_uring is selected with MP_WAVY_KERNEL=io_uring (--enable-io-uring)
 #ifndef MP_WAVY_KERNEL
 #  if   defined(HAVE_SYS_EPOLL_H)
 #    define MP_WAVY_KERNEL epoll
@@ -62,10 +63,12 @@
 //
 //	struct event {
 //		int ident() const;
+//		bool edge_triggered() const;
 //	};
 //
 //
-//	int add_fd(int fd, short event);
+//	int add_fd(int fd, short event);       // one-shot; reactivate() re-arms it
+//	int add_fd_edge(int fd, short event);  // edge-triggered; stays armed
 //	int remove_fd(int fd, short event);
 //
 //
@@ -97,6 +100,20 @@
 //	static int read_signal(event e);
 //
 //
+//	class wakeup {
+//	public:
+//		wakeup();
+//		~wakeup();
+//		int ident() const;
+//	private:
+//		wakeup(const wakeup&);
+//	};
+//
+//	int add_wakeup(wakeup* wk);
+//	static int signal_wakeup(wakeup* wk);  // makes wait() return
+//	static int read_wakeup(event e);
+//
+//
 //	int add_kernel(kernel* pt);
 //	int ident() const;
 //
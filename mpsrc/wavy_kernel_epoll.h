@@ -42,6 +42,10 @@
 #include <sys/signalfd.h>
 #endif
 
+#ifndef DISABLE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 namespace mp {
 namespace wavy {
 
@@ -82,6 +86,8 @@ public:
 
 		int ident() const { return m_data & 0xffffffff; }
 
+		bool edge_triggered() const { return (events() & EPOLLET) != 0; }
+
 	private:
 		uint64_t m_data;
 
@@ -100,6 +106,15 @@ public:
 		return epoll_ctl(m_ep, EPOLL_CTL_ADD, fd, &ev);
 	}
 
+	int add_fd_edge(int fd, short event)
+	{
+		struct epoll_event ev;
+		::memset(&ev, 0, sizeof(ev));  // FIXME valgrind
+		ev.events = event | EPOLLET;
+		ev.data.u64 = ((uint64_t)fd) | ((uint64_t)ev.events << 32);
+		return epoll_ctl(m_ep, EPOLL_CTL_ADD, fd, &ev);
+	}
+
 	int remove_fd(int fd, short event)
 	{
 		return epoll_ctl(m_ep, EPOLL_CTL_DEL, fd, NULL);
@@ -164,6 +179,15 @@ public:
 		return remove_fd(ident, EVKERNEL_READ);
 	}
 
+	// arms the timer to expire once after value
+	int reset_timer(timer* tm, const timespec* value)
+	{
+		struct itimerspec itimer;
+		::memset(&itimer, 0, sizeof(itimer));
+		itimer.it_value = *value;
+		return timerfd_settime(tm->fd, 0, &itimer, NULL);
+	}
+
 	static int read_timer(event e)
 	{
 		uint64_t exp;
@@ -268,6 +292,15 @@ public:
 		return remove_fd(ident, EVKERNEL_READ);
 	}
 
+	// arms the timer to expire once after value
+	int reset_timer(timer* tm, const timespec* value)
+	{
+		struct itimerspec itimer;
+		::memset(&itimer, 0, sizeof(itimer));
+		itimer.it_value = *value;
+		return timer_settime(tm->timer_id, 0, &itimer, 0);
+	}
+
 	static int read_timer(event e)
 	{
 		sigval_t val;
@@ -336,6 +369,123 @@ public:
 #endif
 
 
+#ifndef DISABLE_EVENTFD
+	class wakeup {
+	public:
+		wakeup() : fd(-1) { }
+		~wakeup() {
+			if(fd >= 0) { ::close(fd); }
+		}
+
+		int ident() const { return fd; }
+
+	private:
+		int fd;
+		friend class kernel;
+		wakeup(const wakeup&);
+	};
+
+	int add_wakeup(wakeup* wk)
+	{
+		int fd = eventfd(0, 0);
+		if(fd < 0) {
+			return -1;
+		}
+
+		if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		if(add_fd(fd, EVKERNEL_READ) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		wk->fd = fd;
+		return fd;
+	}
+
+	static int signal_wakeup(wakeup* wk)
+	{
+		uint64_t one = 1;
+		if(::write(wk->fd, &one, sizeof(one)) != sizeof(one)) {
+			return -1;
+		}
+		return 0;
+	}
+
+	static int read_wakeup(event e)
+	{
+		uint64_t val;
+		if(read(e.ident(), &val, sizeof(val)) <= 0) {
+			return -1;
+		}
+		return 0;
+	}
+#else // DISABLE_EVENTFD
+	class wakeup {
+	public:
+		wakeup() : rfd(-1), wfd(-1) { }
+		~wakeup() {
+			if(rfd >= 0) {
+				::close(wfd);
+				::close(rfd);
+			}
+		}
+
+		int ident() const { return rfd; }
+
+	private:
+		int rfd;
+		int wfd;
+		friend class kernel;
+		wakeup(const wakeup&);
+	};
+
+	int add_wakeup(wakeup* wk)
+	{
+		int pipefd[2];
+		if(pipe(pipefd) < 0) {
+			return -1;
+		}
+
+		if(::fcntl(pipefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+				::fcntl(pipefd[1], F_SETFL, O_NONBLOCK) < 0) {
+			::close(pipefd[1]);
+			::close(pipefd[0]);
+			return -1;
+		}
+
+		if(add_fd(pipefd[0], EVKERNEL_READ) < 0) {
+			::close(pipefd[1]);
+			::close(pipefd[0]);
+			return -1;
+		}
+
+		wk->rfd = pipefd[0];
+		wk->wfd = pipefd[1];
+		return pipefd[0];
+	}
+
+	static int signal_wakeup(wakeup* wk)
+	{
+		char c = 0;
+		if(::write(wk->wfd, &c, 1) != 1 && errno != EAGAIN) {
+			return -1;
+		}
+		return 0;
+	}
+
+	static int read_wakeup(event e)
+	{
+		char buf[64];
+		while(read(e.ident(), buf, sizeof(buf)) > 0) { }
+		return 0;
+	}
+#endif
+
+
 	int add_kernel(kernel* kern)
 	{
 		if(add_fd(kern->m_ep, EVKERNEL_READ) < 0) {
@@ -389,6 +539,9 @@ public:
 
 	int reactivate(event e)
 	{
+		if(e.edge_triggered()) {
+			return 0;  // still armed
+		}
 		struct epoll_event ev;
 		::memset(&ev, 0, sizeof(ev));  // FIXME valgrind
 		ev.events = e.events();
@@ -0,0 +1,1217 @@
+//
+// mpio wavy kernel io_uring
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef MP_WAVY_KERNEL_IO_URING_H__
+#define MP_WAVY_KERNEL_IO_URING_H__
+
+#include "mp/exception.h"
+#include "mp/pthread.h"
+#include "mp/wavy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <vector>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#if defined(DISABLE_TIMERFD) || defined(DISABLE_SIGNALFD) || defined(DISABLE_EVENTFD)
+#error io_uring kernel requires timerfd, signalfd and eventfd
+#endif
+
+// out engine submits writes to the kernel (see wavy_out.cc)
+#define MP_WAVY_KERNEL_IO_URING
+
+// multishot accept and recv into provided buffers
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT)
+#define MP_WAVY_KERNEL_RECV
+#endif
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+// number of submission queue entries
+#ifndef MP_WAVY_KERNEL_URING_ENTRIES
+#define MP_WAVY_KERNEL_URING_ENTRIES 4096
+#endif
+
+// number and size of the buffers provided for multishot recvs
+#ifndef MP_WAVY_KERNEL_URING_BUFFERS
+#define MP_WAVY_KERNEL_URING_BUFFERS 256
+#endif
+#ifndef MP_WAVY_KERNEL_URING_BUFFER_SIZE
+#define MP_WAVY_KERNEL_URING_BUFFER_SIZE 16*1024
+#endif
+
+namespace mp {
+namespace wavy {
+
+
+static const short EVKERNEL_READ  = POLLIN;
+static const short EVKERNEL_WRITE = POLLOUT;
+
+
+// Poll requests of io_uring in place of epoll_ctl. add_fd(), reactivate()
+// and remove() only queue a request; the requests are submitted with the
+// next wait() in the same io_uring_enter, or right away if a thread is
+// blocked in wait() or the kernel is watched by another kernel.
+// Edge-triggered fds use multishot polls which stay armed.
+//
+// Requires linux >= 5.13; multishot recv requires linux >= 6.0.
+class kernel {
+public:
+	kernel() :
+		m_fd(-1), m_sq_ring(NULL), m_cq_ring(NULL), m_sqes(NULL),
+		m_gen(NULL), m_waiting(0), m_nested(false)
+#ifdef MP_WAVY_KERNEL_RECV
+		, m_recv_head(NULL), m_recv_tail(NULL),
+		m_pool(NULL), m_heads(NULL), m_lent(0)
+#endif
+	{
+		struct io_uring_params p;
+		::memset(&p, 0, sizeof(p));
+		m_fd = ::syscall(__NR_io_uring_setup, MP_WAVY_KERNEL_URING_ENTRIES, &p);
+		if(m_fd < 0) {
+			throw system_error(errno, "failed to initialize io_uring");
+		}
+
+		if(!(p.features & IORING_FEAT_EXT_ARG) ||
+				!(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+			destroy();
+			throw system_error(ENOSYS, "io_uring requires linux >= 5.13");
+		}
+
+		m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if(p.features & IORING_FEAT_SINGLE_MMAP) {
+			if(m_cq_ring_size > m_sq_ring_size) {
+				m_sq_ring_size = m_cq_ring_size;
+			}
+			m_cq_ring_size = 0;
+		}
+		m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+		m_sq_ring = map(m_sq_ring_size, IORING_OFF_SQ_RING);
+		if(m_cq_ring_size == 0) {
+			m_cq_ring = m_sq_ring;
+		} else {
+			m_cq_ring = map(m_cq_ring_size, IORING_OFF_CQ_RING);
+		}
+		m_sqes = (struct io_uring_sqe*)map(m_sqes_size, IORING_OFF_SQES);
+		if(!m_sq_ring || !m_cq_ring || !m_sqes) {
+			int err = errno;
+			destroy();
+			throw system_error(err, "failed to map io_uring");
+		}
+
+		m_sq_khead   = (unsigned*)(m_sq_ring + p.sq_off.head);
+		m_sq_ktail   = (unsigned*)(m_sq_ring + p.sq_off.tail);
+		m_sq_mask    = *(unsigned*)(m_sq_ring + p.sq_off.ring_mask);
+		m_sq_entries = *(unsigned*)(m_sq_ring + p.sq_off.ring_entries);
+		m_sq_tail    = *m_sq_ktail;
+
+		// submission queue entries are used in order
+		unsigned* array = (unsigned*)(m_sq_ring + p.sq_off.array);
+		for(unsigned i=0; i < m_sq_entries; ++i) {
+			array[i] = i;
+		}
+
+		m_cq_khead = (unsigned*)(m_cq_ring + p.cq_off.head);
+		m_cq_ktail = (unsigned*)(m_cq_ring + p.cq_off.tail);
+		m_cq_mask  = *(unsigned*)(m_cq_ring + p.cq_off.ring_mask);
+		m_cqes     = (struct io_uring_cqe*)(m_cq_ring + p.cq_off.cqes);
+
+		m_max = max();
+		m_gen = (volatile uint16_t*)::calloc(m_max, sizeof(uint16_t));
+		if(!m_gen) {
+			destroy();
+			throw std::bad_alloc();
+		}
+	}
+
+	~kernel()
+	{
+		destroy();
+	}
+
+	size_t max() const
+	{
+		struct rlimit rbuf;
+		if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
+			throw system_error(errno, "getrlimit() failed");
+		}
+		return rbuf.rlim_cur;
+	}
+
+
+	// user_data of a request:
+	//   fd (32 bits) | poll events (15) | edge (1) | generation (13) |
+	//   write (1) | xfer (1) | internal (1)
+	// the generation of an fd is bumped when it is removed, so that
+	// completions of the requests before that are ignored.
+	class event {
+	public:
+		event() : m_data(0), m_res(0) { }
+		explicit event(uint64_t data, int res = 0) : m_data(data), m_res(res) { }
+		~event() { }
+
+		int ident() const { return m_data & 0xffffffff; }
+
+		bool edge_triggered() const { return (m_data & DATA_EDGE) != 0; }
+
+		// completion of submit_writev()
+		bool is_write() const { return (m_data & DATA_WRITE) != 0; }
+
+		// results of add_fd_recv() or add_fd_accept() are queued;
+		// take() them
+		bool is_recv()   const { return events() == EVKERNEL_RECV; }
+		bool is_accept() const { return events() == EVKERNEL_ACCEPT; }
+
+		// bytes written by submit_writev(), or -errno
+		int result() const { return m_res; }
+
+	private:
+		uint64_t m_data;
+		int m_res;
+
+		uint64_t data()   const { return m_data; }
+		short events()    const { return (m_data >> 32) & 0x7fff; }
+		uint16_t gen()    const { return (m_data >> 48) & GEN_MASK; }
+		friend class kernel;
+	};
+
+
+	int add_fd(int fd, short event)
+	{
+		return add_poll(fd, event, false);
+	}
+
+	int add_fd_edge(int fd, short event)
+	{
+		return add_poll(fd, event, true);
+	}
+
+	int remove_fd(int fd, short event)
+	{
+		if(fd < 0 || (size_t)fd >= m_max) {
+			errno = EBADF;
+			return -1;
+		}
+		pthread_scoped_lock lk(m_sq_mutex);
+		uint16_t gen = m_gen[fd];
+		// the request may be for either event, with either trigger
+		static const short events[] = {EVKERNEL_READ, EVKERNEL_WRITE};
+		for(size_t i=0; i < 2; ++i) {
+			queue_remove(make_data(fd, events[i], false, gen));
+			queue_remove(make_data(fd, events[i], true, gen));
+		}
+#ifdef MP_WAVY_KERNEL_RECV
+		if(m_recv_head) {
+			queue_remove(make_data(fd, EVKERNEL_RECV, true, gen));
+			queue_remove(make_data(fd, EVKERNEL_ACCEPT, true, gen));
+		}
+#endif
+		m_gen[fd] = (gen + 1) & GEN_MASK;
+		commit();
+		lk.unlock();
+		flush_received(fd);
+		return 0;
+	}
+
+
+#ifdef MP_WAVY_KERNEL_RECV
+	// Result of a multishot request, queued on the fd until the
+	// handler takes it. Each provided buffer has a result which is
+	// reused; the other results are allocated.
+	struct received {
+		recv_buffer::block block;  // shared by recv_buffers
+		kernel* owner;
+		received* next;
+		int res;  // bytes received, an accepted fd or -errno
+		bool accepted;
+		uint16_t bid;  // of the buffer, or NO_BID
+		char* buf;
+	};
+
+	// Receives on the fd with a multishot recv which fills the
+	// buffers provided to the kernel.
+	int add_fd_recv(int fd)
+	{
+		if(init_received() < 0 || init_buffers() < 0) {
+			return -1;
+		}
+		return add_multishot(fd, EVKERNEL_RECV);
+	}
+
+	// Accepts on the listening fd with a multishot accept.
+	int add_fd_accept(int fd)
+	{
+		if(init_received() < 0) {
+			return -1;
+		}
+		return add_multishot(fd, EVKERNEL_ACCEPT);
+	}
+
+	// Takes the next result queued on the fd, or returns NULL.
+	// Received data is released by recv_buffer; the other results
+	// are freed with free_received().
+	received* take(int fd)
+	{
+		pthread_scoped_lock lk(m_recv_mutex);
+		received* r = m_recv_head[fd];
+		if(r) {
+			m_recv_head[fd] = r->next;
+			if(!r->next) {
+				m_recv_tail[fd] = NULL;
+			}
+		}
+		return r;
+	}
+
+	static void free_received(received* r)
+	{
+		if(r->bid == NO_BID) {
+			::free(r);
+		} else {
+			r->owner->give_back(r);
+		}
+	}
+#endif
+
+
+	class timer {
+	public:
+		timer() : fd(-1) { }
+		~timer() {
+			if(fd >= 0) { ::close(fd); }
+		}
+
+		int ident() const { return fd; }
+
+	private:
+		int fd;
+		friend class kernel;
+		timer(const timer&);
+	};
+
+	int add_timer(timer* tm, const timespec* value, const timespec* interval)
+	{
+		int fd = timerfd_create(CLOCK_REALTIME, 0);
+		if(fd < 0) {
+			return -1;
+		}
+
+		if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		struct itimerspec itimer;
+		::memset(&itimer, 0, sizeof(itimer));
+		if(interval) {
+			itimer.it_interval = *interval;
+		}
+		if(value) {
+			itimer.it_value = *value;
+		} else {
+			itimer.it_value = itimer.it_interval;
+		}
+
+		if(timerfd_settime(fd, 0, &itimer, NULL) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		if(add_fd(fd, EVKERNEL_READ) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		tm->fd = fd;
+		return fd;
+	}
+
+	int remove_timer(int ident)
+	{
+		return remove_fd(ident, EVKERNEL_READ);
+	}
+
+	// arms the timer to expire once after value
+	int reset_timer(timer* tm, const timespec* value)
+	{
+		struct itimerspec itimer;
+		::memset(&itimer, 0, sizeof(itimer));
+		itimer.it_value = *value;
+		return timerfd_settime(tm->fd, 0, &itimer, NULL);
+	}
+
+	static int read_timer(event e)
+	{
+		uint64_t exp;
+		if(read(e.ident(), &exp, sizeof(uint64_t)) <= 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+
+	class signal {
+	public:
+		signal() : fd(-1) { }
+		~signal() {
+			if(fd >= 0) { ::close(fd); }
+		}
+
+		int ident() const { return fd; }
+
+	private:
+		int fd;
+		friend class kernel;
+		signal(const signal&);
+	};
+
+	int add_signal(signal* sg, int signo)
+	{
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, signo);
+
+		int fd = signalfd(-1, &mask, 0);
+		if(fd < 0) {
+			return -1;
+		}
+
+		if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		if(add_fd(fd, EVKERNEL_READ) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		sg->fd = fd;
+		return fd;
+	}
+
+	int remove_signal(int ident)
+	{
+		return remove_fd(ident, EVKERNEL_READ);
+	}
+
+	static int read_signal(event e)
+	{
+		signalfd_siginfo info;
+		if(read(e.ident(), &info, sizeof(info)) <= 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+
+	class wakeup {
+	public:
+		wakeup() : fd(-1) { }
+		~wakeup() {
+			if(fd >= 0) { ::close(fd); }
+		}
+
+		int ident() const { return fd; }
+
+	private:
+		int fd;
+		friend class kernel;
+		wakeup(const wakeup&);
+	};
+
+	int add_wakeup(wakeup* wk)
+	{
+		int fd = eventfd(0, 0);
+		if(fd < 0) {
+			return -1;
+		}
+
+		if(::fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		if(add_fd(fd, EVKERNEL_READ) < 0) {
+			::close(fd);
+			return -1;
+		}
+
+		wk->fd = fd;
+		return fd;
+	}
+
+	static int signal_wakeup(wakeup* wk)
+	{
+		uint64_t one = 1;
+		if(::write(wk->fd, &one, sizeof(one)) != sizeof(one)) {
+			return -1;
+		}
+		return 0;
+	}
+
+	static int read_wakeup(event e)
+	{
+		uint64_t val;
+		if(read(e.ident(), &val, sizeof(val)) <= 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+
+	// the fd of an io_uring is readable while it has completions.
+	// requests to the watched kernel are submitted right away, because
+	// nobody waits on it.
+	int add_kernel(kernel* kern)
+	{
+		{
+			pthread_scoped_lock lk(kern->m_sq_mutex);
+			kern->m_nested = true;
+			kern->commit();
+		}
+		if(add_fd(kern->m_fd, EVKERNEL_READ) < 0) {
+			return -1;
+		}
+		return kern->m_fd;
+	}
+
+	int ident() const
+	{
+		return m_fd;
+	}
+
+
+	// Writes vec to the fd after it becomes writable, with a poll and
+	// a writev linked in one submission. vec is read by the kernel and
+	// must be kept until the completion, which is an event of is_write().
+	int submit_writev(int fd, const struct iovec* vec, size_t veclen)
+	{
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(m_sq_entries - (m_sq_tail - load_acquire(m_sq_khead)) < 2) {
+			submit();  // the linked requests go in one submission
+			if(m_sq_entries - (m_sq_tail - load_acquire(m_sq_khead)) < 2) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+
+		// both are published by submit() at once
+		struct io_uring_sqe* sqe = get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = DATA_INTERNAL;
+		push_sqe();
+
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)vec;
+		sqe->len = veclen;
+		sqe->user_data = make_data(fd, EVKERNEL_WRITE, false, 0) |
+			DATA_XFER | DATA_WRITE;
+		push_sqe();
+
+		submit();
+		return 0;
+	}
+
+	// Waits until the fd becomes writable, without a registration.
+	// The completion is an event which is not is_write().
+	int submit_poll_write(int fd)
+	{
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(queue_poll(make_data(fd, EVKERNEL_WRITE, false, 0) | DATA_XFER,
+					EVKERNEL_WRITE, false) < 0) {
+			return -1;
+		}
+		submit();
+		return 0;
+	}
+
+
+	class backlog {
+	public:
+		backlog()
+		{
+			buf = (uint64_t*)::calloc(
+					sizeof(uint64_t),
+					MP_WAVY_KERNEL_BACKLOG_SIZE);
+			res = (int*)::calloc(
+					sizeof(int),
+					MP_WAVY_KERNEL_BACKLOG_SIZE);
+			if(!buf || !res) {
+				::free(buf);
+				::free(res);
+				throw std::bad_alloc();
+			}
+		}
+
+		~backlog()
+		{
+			::free(buf);
+			::free(res);
+		}
+
+		event operator[] (int n)
+		{
+			return event(buf[n], res[n]);
+		}
+
+	private:
+		uint64_t* buf;
+		int* res;
+		friend class kernel;
+		backlog(const backlog&);
+	};
+
+	int wait(backlog* result)
+	{
+		return wait(result, -1);
+	}
+
+	int wait(backlog* result, int timeout_msec)
+	{
+		int num = reap(result);
+		if(num > 0 || timeout_msec == 0) {
+			{
+				pthread_scoped_lock lk(m_sq_mutex);
+				submit();
+			}
+			if(num == 0) {
+				num = reap(result);
+			}
+			return num;
+		}
+
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg arg;
+		::memset(&arg, 0, sizeof(arg));
+		if(timeout_msec > 0) {
+			ts.tv_sec  = timeout_msec / 1000;
+			ts.tv_nsec = (timeout_msec % 1000) * 1000000;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+
+		// submits the queued requests and waits in one system call.
+		// the count is of the whole ring: a count taken here may be stale
+		// when the kernel reads the ring, and stop it in the middle of a
+		// linked pair published since. requests are published under the
+		// lock all at once, so the kernel sees a pair whole or not at all.
+		unsigned to_submit;
+		{
+			pthread_scoped_lock lk(m_sq_mutex);
+			__sync_add_and_fetch(&m_waiting, 1);
+			publish();
+			to_submit = (m_sq_tail != load_acquire(m_sq_khead)) ? m_sq_entries : 0;
+		}
+		int ret = ::syscall(__NR_io_uring_enter, m_fd, to_submit, 1,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				&arg, sizeof(arg));
+		int err = errno;
+		__sync_sub_and_fetch(&m_waiting, 1);
+
+		num = reap(result);
+		if(num == 0 && ret < 0 && err != ETIME && err != EBUSY) {
+			errno = err;
+			return -1;
+		}
+		return num;
+	}
+
+	int reactivate(event e)
+	{
+		if(e.edge_triggered()) {
+			return 0;  // still armed
+		}
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(!is_current(e)) {
+			return 0;  // removed
+		}
+		if(queue_poll(e.data(), e.events(), false) < 0) {
+			return -1;
+		}
+		commit();
+		return 0;
+	}
+
+	int remove(event e)
+	{
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(!is_current(e)) {
+			return 0;  // already removed
+		}
+		int fd = e.ident();
+		queue_remove(e.data());
+		m_gen[fd] = (m_gen[fd] + 1) & GEN_MASK;
+		commit();
+		lk.unlock();
+		flush_received(fd);
+		return 0;
+	}
+
+private:
+	static const uint64_t DATA_EDGE     = 1ULL << 47;
+	static const uint64_t DATA_WRITE    = 1ULL << 61;
+	static const uint64_t DATA_XFER     = 1ULL << 62;  // not registered
+	static const uint64_t DATA_INTERNAL = 1ULL << 63;
+	static const uint16_t GEN_MASK      = 0x1fff;
+
+	// events of multishot requests other than polls
+	static const short EVKERNEL_RECV   = 0x1000;
+	static const short EVKERNEL_ACCEPT = 0x2000;
+
+	static const uint16_t NO_BID = 0xffff;
+
+	static uint64_t make_data(int fd, short event, bool edge, uint16_t gen)
+	{
+		return (uint64_t)(uint32_t)fd |
+			((uint64_t)(event & 0x7fff) << 32) |
+			(edge ? DATA_EDGE : 0) |
+			((uint64_t)(gen & GEN_MASK) << 48);
+	}
+
+	static unsigned load_acquire(const unsigned* p)
+	{
+		unsigned v = *(volatile const unsigned*)p;
+		__sync_synchronize();
+		return v;
+	}
+
+	static void store_release(unsigned* p, unsigned v)
+	{
+		__sync_synchronize();
+		*(volatile unsigned*)p = v;
+	}
+
+	char* map(size_t size, off_t offset)
+	{
+		void* p = ::mmap(NULL, size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE, m_fd, offset);
+		return p == MAP_FAILED ? NULL : (char*)p;
+	}
+
+	void destroy()
+	{
+#ifdef MP_WAVY_KERNEL_RECV
+		if(m_recv_head) {
+			for(size_t fd=0; fd < m_max; ++fd) {
+				flush_received(fd);
+			}
+		}
+#endif
+		if(m_sqes) {
+			::munmap(m_sqes, m_sqes_size);
+		}
+		if(m_cq_ring && m_cq_ring != m_sq_ring) {
+			::munmap(m_cq_ring, m_cq_ring_size);
+		}
+		if(m_sq_ring) {
+			::munmap(m_sq_ring, m_sq_ring_size);
+		}
+		if(m_fd >= 0) {
+			::close(m_fd);
+		}
+		::free((void*)m_gen);
+#ifdef MP_WAVY_KERNEL_RECV
+		::free(m_recv_head);
+		::free(m_recv_tail);
+		::free(m_pool);
+		::free(m_heads);
+#endif
+	}
+
+#ifdef MP_WAVY_KERNEL_RECV
+	int init_received()
+	{
+		pthread_scoped_lock lk(m_recv_mutex);
+		if(m_recv_head) {
+			return 0;
+		}
+		m_recv_tail = (received**)::calloc(m_max, sizeof(received*));
+		m_recv_head = (received**)::calloc(m_max, sizeof(received*));
+		if(!m_recv_head || !m_recv_tail) {
+			::free(m_recv_tail);
+			::free(m_recv_head);
+			m_recv_head = m_recv_tail = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+		return 0;
+	}
+
+	// provides the buffers on first use
+	int init_buffers()
+	{
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(m_pool) {
+			return 0;
+		}
+
+		char* pool = (char*)::malloc(
+				MP_WAVY_KERNEL_URING_BUFFER_SIZE * MP_WAVY_KERNEL_URING_BUFFERS);
+		received* heads = (received*)::calloc(
+				MP_WAVY_KERNEL_URING_BUFFERS, sizeof(received));
+		if(!pool || !heads) {
+			::free(pool);
+			::free(heads);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		for(unsigned i=0; i < MP_WAVY_KERNEL_URING_BUFFERS; ++i) {
+			received* r = &heads[i];
+			r->block.release = &release_buffer;
+			r->owner = this;
+			r->buf = pool + MP_WAVY_KERNEL_URING_BUFFER_SIZE * i;
+			r->bid = i;
+		}
+
+		// submitted before the recvs which use them
+		if(queue_provide(pool, MP_WAVY_KERNEL_URING_BUFFERS, 0) < 0) {
+			::free(pool);
+			::free(heads);
+			return -1;
+		}
+		submit();
+
+		m_pool = pool;
+		m_heads = heads;
+		return 0;
+	}
+
+	// called with m_sq_mutex locked
+	int queue_provide(char* buf, unsigned num, uint16_t bid)
+	{
+		struct io_uring_sqe* sqe = get_sqe();
+		if(!sqe) {
+			return -1;
+		}
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = num;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = MP_WAVY_KERNEL_URING_BUFFER_SIZE;
+		sqe->off = bid;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = DATA_INTERNAL;
+		push_sqe();
+		return 0;
+	}
+
+	static void release_buffer(recv_buffer::block* b)
+	{
+		received* r = reinterpret_cast<received*>(b);
+		r->owner->give_back(r);
+	}
+
+	// provides the buffer again, and rearms the recvs which ran out
+	// of buffers
+	void give_back(received* r)
+	{
+		pthread_scoped_lock lk(m_sq_mutex);
+		queue_provide(r->buf, 1, r->bid);
+		--m_lent;
+		if(!m_starved.empty()) {
+			std::vector<uint64_t> starved;
+			starved.swap(m_starved);
+			for(size_t i=0; i < starved.size(); ++i) {
+				event e(starved[i]);
+				if(is_current(e)) {
+					queue_multishot(e.data(), e.events());
+				}
+			}
+		}
+		commit();
+	}
+
+	int add_multishot(int fd, short event)
+	{
+		if(fd < 0 || (size_t)fd >= m_max) {
+			errno = EBADF;
+			return -1;
+		}
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(queue_multishot(make_data(fd, event, true, m_gen[fd]), event) < 0) {
+			return -1;
+		}
+		commit();
+		return 0;
+	}
+
+	// called with m_sq_mutex locked
+	int queue_multishot(uint64_t data, short event)
+	{
+		struct io_uring_sqe* sqe = get_sqe();
+		if(!sqe) {
+			return -1;
+		}
+		sqe->fd = (int)(data & 0xffffffff);
+		if(event == EVKERNEL_RECV) {
+			sqe->opcode = IORING_OP_RECV;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = BUFFER_GROUP;
+		} else {
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		}
+		sqe->user_data = data;
+		push_sqe();
+		return 0;
+	}
+
+	// Queues the result of a multishot request on the fd. Returns
+	// false if there is nothing for the handler.
+	bool deliver(uint64_t data, struct io_uring_cqe* cqe)
+	{
+		event e(data);
+		int fd = e.ident();
+
+		received* r = NULL;
+		{
+			pthread_scoped_lock lk(m_sq_mutex);
+			if(cqe->flags & IORING_CQE_F_BUFFER) {
+				r = &m_heads[cqe->flags >> IORING_CQE_BUFFER_SHIFT];
+				r->block.count = 1;
+				++m_lent;
+			}
+
+			if(!is_current(e)) {
+				// removed
+				if(r) {
+					lk.unlock();
+					give_back(r);
+				} else if(e.is_accept() && cqe->res >= 0) {
+					::close(cqe->res);
+				}
+				return false;
+			}
+
+			if(!(cqe->flags & IORING_CQE_F_MORE)) {
+				// the multishot request is terminated
+				if(cqe->res == -ENOBUFS) {
+					if(m_lent < MP_WAVY_KERNEL_URING_BUFFERS) {
+						// buffers were given back in between
+						queue_multishot(data, e.events());
+						commit();
+					} else {
+						m_starved.push_back(data);
+					}
+					return false;
+				} else if(cqe->res > 0 || (e.is_accept() && cqe->res == 0)) {
+					queue_multishot(data, e.events());
+					commit();
+				}
+				// an error or the end of the stream goes to the handler
+			}
+		}
+
+		if(!r) {
+			r = (received*)::malloc(sizeof(received));
+			if(!r) {
+				if(e.is_accept() && cqe->res >= 0) {
+					::close(cqe->res);
+				}
+				return false;
+			}
+			r->owner = this;
+			r->bid = NO_BID;
+		}
+		r->res = cqe->res;
+		r->accepted = e.is_accept();
+		r->next = NULL;
+
+		pthread_scoped_lock lk(m_recv_mutex);
+		if(m_recv_tail[fd]) {
+			m_recv_tail[fd]->next = r;
+		} else {
+			m_recv_head[fd] = r;
+		}
+		m_recv_tail[fd] = r;
+		return true;
+	}
+#endif
+
+	// releases the results which the removed fd left
+	void flush_received(int fd)
+	{
+#ifdef MP_WAVY_KERNEL_RECV
+		if(!m_recv_head || fd < 0 || (size_t)fd >= m_max) {
+			return;
+		}
+		received* r;
+		{
+			pthread_scoped_lock lk(m_recv_mutex);
+			r = m_recv_head[fd];
+			m_recv_head[fd] = m_recv_tail[fd] = NULL;
+		}
+		while(r) {
+			received* next = r->next;
+			if(r->accepted && r->res >= 0) {
+				::close(r->res);
+			}
+			free_received(r);
+			r = next;
+		}
+#else
+		(void)fd;
+#endif
+	}
+
+	// called with m_sq_mutex locked
+	bool is_current(event e) const
+	{
+		int fd = e.ident();
+		return fd >= 0 && (size_t)fd < m_max && m_gen[fd] == e.gen();
+	}
+
+	int add_poll(int fd, short event, bool edge)
+	{
+		if(fd < 0 || (size_t)fd >= m_max) {
+			errno = EBADF;
+			return -1;
+		}
+		pthread_scoped_lock lk(m_sq_mutex);
+		if(queue_poll(make_data(fd, event, edge, m_gen[fd]), event, edge) < 0) {
+			return -1;
+		}
+		commit();
+		return 0;
+	}
+
+	// called with m_sq_mutex locked
+	struct io_uring_sqe* get_sqe()
+	{
+		if(m_sq_tail - load_acquire(m_sq_khead) >= m_sq_entries) {
+			submit();  // make room
+			if(m_sq_tail - load_acquire(m_sq_khead) >= m_sq_entries) {
+				errno = EAGAIN;
+				return NULL;
+			}
+		}
+		struct io_uring_sqe* sqe = &m_sqes[m_sq_tail & m_sq_mask];
+		::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	// called with m_sq_mutex locked. the kernel sees the entry after
+	// publish()
+	void push_sqe()
+	{
+		++m_sq_tail;
+	}
+
+	// called with m_sq_mutex locked
+	void publish()
+	{
+		store_release(m_sq_ktail, m_sq_tail);
+	}
+
+	// called with m_sq_mutex locked
+	int queue_poll(uint64_t data, short event, bool multishot)
+	{
+		struct io_uring_sqe* sqe = get_sqe();
+		if(!sqe) {
+			return -1;
+		}
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = (int)(data & 0xffffffff);
+		sqe->poll32_events = (unsigned short)event;
+		sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+		sqe->user_data = data;
+		push_sqe();
+		return 0;
+	}
+
+	// called with m_sq_mutex locked
+	int queue_remove(uint64_t data)
+	{
+		struct io_uring_sqe* sqe = get_sqe();
+		if(!sqe) {
+			return -1;
+		}
+		short ev = event(data).events();
+		if(ev == EVKERNEL_RECV || ev == EVKERNEL_ACCEPT) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		} else {
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+		}
+		sqe->fd = -1;
+		sqe->addr = data;
+		sqe->user_data = DATA_INTERNAL;
+		push_sqe();
+		return 0;
+	}
+
+	// called with m_sq_mutex locked. the requests the kernel doesn't
+	// take now (EAGAIN, EBUSY) stay in the ring for the next wait().
+	void submit()
+	{
+		publish();
+		while(true) {
+			unsigned to_submit = m_sq_tail - load_acquire(m_sq_khead);
+			if(to_submit == 0) {
+				return;
+			}
+			int ret = ::syscall(__NR_io_uring_enter, m_fd, to_submit, 0, 0, NULL, 0);
+			if(ret < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				return;
+			}
+			if(ret == 0) {
+				return;
+			}
+			// a short submit: the rest is tried again
+		}
+	}
+
+	// called with m_sq_mutex locked. requests wait for the next wait()
+	// unless nobody would submit them soon.
+	void commit()
+	{
+		if(m_nested || m_waiting > 0) {
+			submit();
+		}
+	}
+
+	int reap(backlog* result)
+	{
+		pthread_scoped_lock lk(m_cq_mutex);
+		unsigned head = *m_cq_khead;
+		unsigned tail = load_acquire(m_cq_ktail);
+		int num = 0;
+		while(head != tail && num < MP_WAVY_KERNEL_BACKLOG_SIZE) {
+			struct io_uring_cqe* cqe = &m_cqes[head & m_cq_mask];
+			++head;
+
+			uint64_t data = cqe->user_data;
+			if(data & DATA_INTERNAL) {
+				continue;
+			}
+			if(data & DATA_XFER) {
+				result->res[num] = cqe->res;
+				result->buf[num++] = data;
+				continue;
+			}
+			if(cqe->res == -ECANCELED) {
+				continue;
+			}
+			event e(data);
+#ifdef MP_WAVY_KERNEL_RECV
+			if(e.is_recv() || e.is_accept()) {
+				if(deliver(data, cqe)) {
+					result->res[num] = cqe->res;
+					result->buf[num++] = data;
+				}
+				continue;
+			}
+#endif
+			if(e.edge_triggered() && !(cqe->flags & IORING_CQE_F_MORE)) {
+				// the multishot poll is terminated
+				pthread_scoped_lock sq(m_sq_mutex);
+				if(!is_current(e)) {
+					continue;
+				}
+				queue_poll(data, e.events(), true);
+				commit();
+			} else if(m_gen[e.ident()] != e.gen()) {
+				continue;  // removed
+			}
+			result->res[num] = cqe->res;
+			result->buf[num++] = data;
+		}
+		store_release(m_cq_khead, head);
+		return num;
+	}
+
+private:
+	int m_fd;
+
+	char* m_sq_ring;
+	char* m_cq_ring;
+	struct io_uring_sqe* m_sqes;
+	size_t m_sq_ring_size;
+	size_t m_cq_ring_size;
+	size_t m_sqes_size;
+
+	pthread_mutex m_sq_mutex;
+	unsigned* m_sq_khead;
+	unsigned* m_sq_ktail;
+	unsigned m_sq_mask;
+	unsigned m_sq_entries;
+	unsigned m_sq_tail;
+
+	pthread_mutex m_cq_mutex;
+	unsigned* m_cq_khead;
+	unsigned* m_cq_ktail;
+	unsigned m_cq_mask;
+	struct io_uring_cqe* m_cqes;
+
+	size_t m_max;
+	volatile uint16_t* m_gen;  // generation of each fd
+
+	volatile int m_waiting;  // threads blocked in wait()
+	bool m_nested;  // watched by another kernel
+
+#ifdef MP_WAVY_KERNEL_RECV
+	static const uint16_t BUFFER_GROUP = 0;
+
+	pthread_mutex m_recv_mutex;
+	received** m_recv_head;  // results queued on each fd
+	received** m_recv_tail;
+
+	// buffers provided to the kernel, guarded by m_sq_mutex
+	char* m_pool;
+	received* m_heads;
+	size_t m_lent;  // buffers filled and not given back
+	std::vector<uint64_t> m_starved;  // recvs which ran out of buffers
+#endif
+
+private:
+	kernel(const kernel&);
+};
+
+
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_kernel_io_uring.h */
+
@@ -118,6 +118,8 @@ public:
 			return kev.ident;
 		}
 
+		bool edge_triggered() const { return (kev.flags & EV_CLEAR) != 0; }
+
 	private:
 		struct kevent kev;
 		friend class kernel;
@@ -129,6 +131,11 @@ public:
 		return set_event(fd, event, EV_ADD|EV_ONESHOT, 0, 0, NULL);
 	}
 
+	int add_fd_edge(int fd, short event)
+	{
+		return set_event(fd, event, EV_ADD|EV_CLEAR, 0, 0, NULL);
+	}
+
 	int remove_fd(int fd, short event)
 	{
 		return set_event(fd, event, EV_DELETE, 0, 0, NULL);
@@ -176,7 +183,8 @@ public:
 			data = udata;
 		}
 
-		if(set_event(xident, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0,
+		// a timer of zero is disarmed, like a timerfd
+		if(data != 0 && set_event(xident, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0,
 					data, (void*)udata) < 0) {
 			free_xident(xident);
 			return -1;
@@ -192,6 +200,17 @@ public:
 		return set_event(ident, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
 	}
 
+	// arms the timer to expire once after value
+	int reset_timer(timer* tm, const timespec* value)
+	{
+		unsigned long data = value->tv_sec*1000 + value->tv_nsec/1000/1000;
+		if(data == 0) {
+			data = 1;
+		}
+		return set_event(tm->xident, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0,
+				data, NULL);
+	}
+
 	static int read_timer(event e)
 	{
 		return 0;
@@ -248,6 +267,56 @@ public:
 	}
 
 
+	class wakeup {
+	public:
+		wakeup() : xident(-1) { }
+		~wakeup() {
+			if(xident >= 0) {
+				kern->set_event(xident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+				kern->free_xident(xident);
+			}
+		}
+
+		int ident() const { return xident; }
+
+	private:
+		int xident;
+		kernel* kern;
+		friend class kernel;
+		wakeup(const wakeup&);
+	};
+
+	friend class wakeup;
+
+	int add_wakeup(wakeup* wk)
+	{
+		int xident = alloc_xident();
+		if(xident < 0) {
+			return -1;
+		}
+
+		if(set_event(xident, EVFILT_USER, EV_ADD|EV_CLEAR, 0, 0, NULL) < 0) {
+			free_xident(xident);
+			return -1;
+		}
+
+		wk->xident = xident;
+		wk->kern = this;
+		return xident;
+	}
+
+	static int signal_wakeup(wakeup* wk)
+	{
+		return wk->kern->set_event(wk->xident, EVFILT_USER,
+				0, NOTE_TRIGGER, 0, NULL);
+	}
+
+	static int read_wakeup(event e)
+	{
+		return 0;
+	}
+
+
 	int add_kernel(kernel* kern)
 	{
 		if(add_fd(kern->m_kq, EVKERNEL_READ) < 0) {
@@ -305,6 +374,10 @@ public:
 
 	int reactivate(event e)
 	{
+		if(e.edge_triggered()) {
+			return 0;  // still armed
+		}
+
 		switch(e.kev.filter) {
 		case EVFILT_READ:
 			return add_fd(e.ident(), EVFILT_READ);
@@ -314,6 +387,9 @@ public:
 
 		case EVFILT_TIMER: {
 				unsigned long data = (uintptr_t)e.kev.udata;
+				if(data == 0) {
+					return 0;  // not periodic
+				}
 				return set_event(e.ident(), EVFILT_TIMER,
 						EV_ADD|EV_ONESHOT, 0, data, (void*)data);
 			}
@@ -335,10 +411,14 @@ public:
 		switch(e.kev.filter) {
 		case EVFILT_READ:
 		case EVFILT_WRITE:
+			if(e.edge_triggered()) {
+				return set_event(e.kev.ident, e.kev.filter, EV_DELETE, 0, 0, NULL);
+			}
 			return 0;
 
 		case EVFILT_TIMER:
 		case EVFILT_SIGNAL:
+		case EVFILT_USER:
 			return 0;
 
 		default:
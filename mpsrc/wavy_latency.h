@@ -0,0 +1,237 @@
+//
+// mpio wavy latency
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef WAVY_LATENCY_H__
+#define WAVY_LATENCY_H__
+
+#include "mp/wavy.h"
+#include <time.h>
+#include <stdint.h>
+#include <typeinfo>
+
+// number of handler types recorded per thread
+#ifndef MP_WAVY_LATENCY_TYPES
+#define MP_WAVY_LATENCY_TYPES 64
+#endif
+
+// timestamp for the handler latency, or 0 if it is not recorded
+#ifdef ENABLE_HANDLER_LATENCY
+#define MP_WAVY_LATENCY_NOW() mp::wavy::latency_clock()
+#else
+#define MP_WAVY_LATENCY_NOW() 0
+#endif
+
+namespace mp {
+namespace wavy {
+namespace {
+
+
+static inline uint64_t latency_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Log-linear histogram of nanoseconds, like HdrHistogram: values below
+// SUB have a bucket each, and every power of 2 above is divided into
+// SUB buckets, so that a bucket is within 1/SUB of its values.
+class latency_histogram_impl {
+public:
+	enum {
+		SUB_BITS = 3,
+		SUB = 1 << SUB_BITS,
+		MAX_EXP = 40,  // about 18 minutes
+		NUM_BUCKETS = (MAX_EXP - SUB_BITS + 2) * SUB
+	};
+
+	latency_histogram_impl() : m_sum(0), m_min(0), m_max(0)
+	{
+		for(size_t i=0; i < NUM_BUCKETS; ++i) {
+			m_count[i] = 0;
+		}
+	}
+
+	static size_t bucket_of(uint64_t v)
+	{
+		if(v < SUB) {
+			return v;
+		}
+		int e = 63 - __builtin_clzll(v);
+		if(e > MAX_EXP) {
+			return NUM_BUCKETS - 1;
+		}
+		return (e - SUB_BITS + 1) * SUB + ((v >> (e - SUB_BITS)) & (SUB - 1));
+	}
+
+	// largest value of the bucket
+	static uint64_t upper_of(size_t idx)
+	{
+		if(idx < SUB) {
+			return idx;
+		}
+		size_t g = idx / SUB;
+		size_t sub = idx % SUB;
+		int shift = g - 1;
+		return ((uint64_t)(SUB + sub + 1) << shift) - 1;
+	}
+
+	// shared histograms are updated with atomic operations
+	void record(uint64_t v, bool shared)
+	{
+		size_t idx = bucket_of(v);
+		if(shared) {
+			__sync_add_and_fetch(&m_count[idx], 1);
+			__sync_add_and_fetch(&m_sum, v);
+			uint64_t cur = m_max;
+			while(v > cur && !__sync_bool_compare_and_swap(&m_max, cur, v)) {
+				cur = m_max;
+			}
+			cur = m_min;
+			while((cur == 0 || v < cur) &&
+					!__sync_bool_compare_and_swap(&m_min, cur, v)) {
+				cur = m_min;
+			}
+		} else {
+			m_count[idx] += 1;
+			m_sum += v;
+			if(v > m_max) { m_max = v; }
+			if(m_min == 0 || v < m_min) { m_min = v; }
+		}
+	}
+
+	void merge_to(loop::latency_histogram* to) const
+	{
+		if(to->buckets.empty()) {
+			to->buckets.resize(NUM_BUCKETS, 0);
+		}
+		uint64_t count = 0;
+		for(size_t i=0; i < NUM_BUCKETS; ++i) {
+			to->buckets[i] += m_count[i];
+			count += m_count[i];
+		}
+		if(count == 0) {
+			return;
+		}
+		if(to->count == 0 || m_min < to->min) { to->min = m_min; }
+		if(m_max > to->max) { to->max = m_max; }
+		to->count += count;
+		to->sum += m_sum;
+	}
+
+private:
+	volatile uint64_t m_count[NUM_BUCKETS];
+	volatile uint64_t m_sum;
+	volatile uint64_t m_min;
+	volatile uint64_t m_max;
+
+private:
+	latency_histogram_impl(const latency_histogram_impl&);
+};
+
+
+// Histograms of one thread (or shared by the threads that are not
+// workers) keyed by the type of the handler. Entries are added by
+// compare-and-swap and never removed, so they are read without locks.
+class latency_table {
+public:
+	latency_table(bool shared) : m_shared(shared)
+	{
+		for(size_t i=0; i < MP_WAVY_LATENCY_TYPES; ++i) {
+			m_entries[i] = NULL;
+		}
+	}
+
+	~latency_table()
+	{
+		for(size_t i=0; i < MP_WAVY_LATENCY_TYPES; ++i) {
+			delete m_entries[i];
+		}
+	}
+
+	struct entry {
+		entry(const std::type_info& t) : type(t) { }
+		const std::type_info& type;
+		latency_histogram_impl dispatch;
+		latency_histogram_impl run;
+	};
+
+	// polled is 0 if the event did not come from a kernel wait
+	void record(const std::type_info& type,
+			uint64_t polled, uint64_t started, uint64_t finished)
+	{
+		entry* e = get(type);
+		if(!e) {
+			return;  // too many handler types
+		}
+		if(polled != 0 && started >= polled) {
+			e->dispatch.record(started - polled, m_shared);
+		}
+		if(finished >= started) {
+			e->run.record(finished - started, m_shared);
+		}
+	}
+
+	size_t size() const
+	{
+		return MP_WAVY_LATENCY_TYPES;
+	}
+
+	// NULL if the slot is not used
+	const entry* at(size_t i) const
+	{
+		return m_entries[i];
+	}
+
+private:
+	entry* get(const std::type_info& type)
+	{
+		size_t h = ((uintptr_t)&type >> 4) % MP_WAVY_LATENCY_TYPES;
+		for(size_t i=0; i < MP_WAVY_LATENCY_TYPES; ++i) {
+			entry* volatile* slot = &m_entries[(h + i) % MP_WAVY_LATENCY_TYPES];
+			entry* e = *slot;
+			if(e == NULL) {
+				entry* n = new entry(type);
+				if(__sync_bool_compare_and_swap(slot, (entry*)NULL, n)) {
+					return n;
+				}
+				delete n;
+				e = *slot;
+			}
+			if(e->type == type) {
+				return e;
+			}
+		}
+		return NULL;
+	}
+
+private:
+	entry* volatile m_entries[MP_WAVY_LATENCY_TYPES];
+	bool m_shared;
+
+private:
+	latency_table(const latency_table&);
+};
+
+
+}  // noname namespace
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_latency.h */
+
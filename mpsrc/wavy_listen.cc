@@ -33,7 +33,10 @@ public:
 	typedef loop::listen_callback_t listen_callback_t;
 
 	listen_handler(int fd, listen_callback_t callback) :
-		handler(fd), m_callback(callback) { }
+		handler(fd), m_callback(callback)
+	{
+		set_accept_event();
+	}
 
 	~listen_handler() { }
 
@@ -41,7 +44,7 @@ public:
 	{
 		while(true) {
 			int err = 0;
-			int sock = ::accept(fd(), NULL, NULL);
+			int sock = e.accept();
 			if(sock < 0) {
 				if(errno == EAGAIN || errno == EINTR) {
 					return;
@@ -58,6 +61,11 @@ public:
 			} catch (...) {
 				::close(sock);
 			}
+
+			e.consume(1);
+			if(e.exhausted()) {
+				return;  // the loop requeues this fd
+			}
 		}
 	}
 
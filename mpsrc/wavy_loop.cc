@@ -17,11 +17,17 @@
 //
 #include "wavy_loop.h"
 #include "wavy_out.h"
+#include "wavy_cpu.h"
+#include "wavy_timer.h"
 #include <sys/types.h>
 #include <sys/resource.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <stdexcept>
+#include <map>
 
 // linkage hack for out::out, out::poll_event and out::write_event
 #include "wavy_out.cc"
@@ -30,47 +36,321 @@
 #define MP_WAVY_TASK_QUEUE_LIMIT 16
 #endif
 
+// a low priority task runs at least once in this many
+// passes of a busy worker, so that it is not starved
+#ifndef MP_WAVY_TASK_LOW_INTERVAL
+#define MP_WAVY_TASK_LOW_INTERVAL 64
+#endif
+
+// the autoscaler adds a thread after the queues stayed deeper than
+// the number of threads for this many samples in a row, and retires
+// one after a thread was found parked for this many samples in a row
+#ifndef MP_WAVY_AUTOSCALE_GROW_SAMPLES
+#define MP_WAVY_AUTOSCALE_GROW_SAMPLES 3
+#endif
+
+#ifndef MP_WAVY_AUTOSCALE_SHRINK_SAMPLES
+#define MP_WAVY_AUTOSCALE_SHRINK_SAMPLES 20
+#endif
+
+// size of the buffers which event::recv() reads into, when the
+// kernel doesn't receive for the handler
+#ifndef MP_WAVY_RECV_BUFFER_SIZE
+#define MP_WAVY_RECV_BUFFER_SIZE 16*1024
+#endif
+
 namespace mp {
 namespace wavy {
 namespace {
 
 
-loop_impl::loop_impl(function<void ()> thread_init_func) :
+static __thread worker* s_current_worker = NULL;
+
+static void free_recv_block(recv_buffer::block* b)
+{
+	::free(b);
+}
+
+stat_counters& loop_impl::local_stats()
+{
+	worker* w = s_current_worker;
+	if(w && w->get_shard()->get_loop() == this) {
+		return w->stats();
+	}
+	return m_shared_stats;
+}
+
+loop::statistics loop_impl::stats() const
+{
+	uint64_t count[stat_counters::NUM];
+	for(int i=0; i < stat_counters::NUM; ++i) {
+		count[i] = m_shared_stats.get(i);
+	}
+
+	size_t num = m_ncontexts;
+	for(size_t n=0; n < num; ++n) {
+		stat_counters& st(m_contexts[n]->stats());
+		for(int i=0; i < stat_counters::NUM; ++i) {
+			if(i == stat_counters::TASK_QUEUE_MAX ||
+					i == stat_counters::POLL_BATCH_MAX) {
+				if(st.get(i) > count[i]) {
+					count[i] = st.get(i);
+				}
+			} else {
+				count[i] += st.get(i);
+			}
+		}
+	}
+
+	loop::statistics result;
+	result.events         = count[stat_counters::EVENTS];
+	result.more           = count[stat_counters::MORE];
+	result.tasks          = count[stat_counters::TASKS];
+	result.task_queue_max = count[stat_counters::TASK_QUEUE_MAX];
+	result.polls          = count[stat_counters::POLLS];
+	result.polled         = count[stat_counters::POLLED];
+	result.poll_batch_max = count[stat_counters::POLL_BATCH_MAX];
+	result.claims         = count[stat_counters::CLAIMS];
+	result.bytes_written  = count[stat_counters::BYTES_WRITTEN];
+	result.write_again    = count[stat_counters::WRITE_AGAIN];
+	result.budget_requeue = count[stat_counters::BUDGET_REQUEUE];
+
+	result.out_queue = 0;
+	for(shards_t::const_iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		result.out_queue += (*it)->get_out()->watching();
+	}
+	return result;
+}
+
+
+#ifdef ENABLE_HANDLER_LATENCY
+latency_table& loop_impl::local_latency()
+{
+	worker* w = s_current_worker;
+	if(w && w->get_shard()->get_loop() == this) {
+		return w->latency();
+	}
+	return m_shared_latency;
+}
+
+static void merge_latency(const latency_table& table,
+		std::map<std::string, loop::handler_latency>* result)
+{
+	for(size_t i=0; i < table.size(); ++i) {
+		const latency_table::entry* e = table.at(i);
+		if(!e) {
+			continue;
+		}
+		loop::handler_latency& to((*result)[e->type.name()]);
+		to.type = e->type.name();
+		e->dispatch.merge_to(&to.dispatch);
+		e->run.merge_to(&to.run);
+	}
+}
+#endif
+
+std::vector<loop::handler_latency> loop_impl::handler_latencies() const
+{
+	std::vector<loop::handler_latency> result;
+#ifdef ENABLE_HANDLER_LATENCY
+	std::map<std::string, loop::handler_latency> merged;
+	merge_latency(m_shared_latency, &merged);
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		merge_latency(m_contexts[i]->latency(), &merged);
+	}
+	for(std::map<std::string, loop::handler_latency>::iterator it(merged.begin());
+			it != merged.end(); ++it) {
+		result.push_back(it->second);
+	}
+#endif
+	return result;
+}
+
+
+// keeps the handler table entries seen by this thread alive
+class handler_pin {
+public:
+	handler_pin(loop_impl* lo) :
+		m_table(lo->get_handlers())
+	{
+		worker* w = s_current_worker;
+		if(w && w->get_shard()->get_loop() == lo) {
+			m_slot = w->epoch_slot();
+			m_borrowed = false;
+		} else {
+			m_slot = m_table.acquire_slot();
+			m_borrowed = true;
+		}
+		m_table.enter(m_slot);
+	}
+
+	~handler_pin()
+	{
+		m_table.leave(m_slot);
+		if(m_borrowed) {
+			m_table.release_slot(m_slot);
+		}
+		if(m_table.has_retired()) {
+			m_table.reclaim();
+		}
+	}
+
+private:
+	handler_table& m_table;
+	handler_table::slot* m_slot;
+	bool m_borrowed;
+
+private:
+	handler_pin(const handler_pin&);
+};
+
+
+shard::shard(loop_impl* lo, void* fdctx) :
 	m_off(0), m_num(0), m_pollable(true),
+	m_poll_blocked(0),
+	m_polled_at(0),
+	m_sleeping(0),
+	m_wake_seq(0),
+	m_low_turn(0),
+	m_running(0),
+	m_flushing(0),
+	m_loop(lo)
+{
+	// add out handler
+	m_out.reset(new out(lo, fdctx));
+	m_kernel.add_kernel(&m_out->get_kernel());
+
+	if(m_kernel.add_wakeup(&m_wakeup) < 0) {
+		throw system_error(errno, "failed to create wakeup event");
+	}
+}
+
+shard::~shard()
+{
+	pthread_scoped_lock lk(m_mutex);
+	m_cond.broadcast();
+}
+
+void shard::wakeup()
+{
+	pthread_scoped_lock lk(m_mutex);
+	__sync_add_and_fetch(&m_wake_seq, 1);
+	m_cond.broadcast();
+	poke();
+}
+
+
+loop_impl::loop_impl(function<void ()> thread_init_func) :
+	m_handlers(NULL),
+	m_service(NULL),
+	m_rr(0),
+	m_timer_wheel(NULL),
+	m_dispatch_batch(1),
+	m_more_budget(0),
+	m_read_budget(0),
+	m_idle_spin(0),
+	m_idle_yield(0),
 	m_thread_init_func(thread_init_func),
-	m_end_flag(false)
+	m_end_flag(false),
+	m_ncontexts(0),
+	m_nthreads(0),
+	m_scale_min(0),
+	m_scale_max(0),
+	m_scale_interval(0),
+	m_scale_busy(0),
+	m_scale_idle(0),
+	m_scaler_running(false),
+	m_shared_stats(true)
+#ifdef ENABLE_HANDLER_LATENCY
+	, m_shared_latency(true)
+#endif
 {
-	m_state = new shared_handler[m_kernel.max()];
+	init(1);
+}
 
-	// add out handler
-	{
-		m_out.reset(new out);
-		set_handler(m_out);
-		get_kernel().add_kernel(&m_out->get_kernel());
+loop_impl::loop_impl(size_t shards, function<void ()> thread_init_func) :
+	m_handlers(NULL),
+	m_service(NULL),
+	m_rr(0),
+	m_timer_wheel(NULL),
+	m_dispatch_batch(1),
+	m_more_budget(0),
+	m_read_budget(0),
+	m_idle_spin(0),
+	m_idle_yield(0),
+	m_thread_init_func(thread_init_func),
+	m_end_flag(false),
+	m_ncontexts(0),
+	m_nthreads(0),
+	m_scale_min(0),
+	m_scale_max(0),
+	m_scale_interval(0),
+	m_scale_busy(0),
+	m_scale_idle(0),
+	m_scaler_running(false),
+	m_shared_stats(true)
+#ifdef ENABLE_HANDLER_LATENCY
+	, m_shared_latency(true)
+#endif
+{
+	if(shards == 0) {
+		throw std::invalid_argument("number of shards must be positive");
+	}
+	init(shards);
+}
+
+void loop_impl::init(size_t shards)
+{
+	m_fdctx = out::alloc_fdctx();
+
+	try {
+		for(size_t i=0; i < shards; ++i) {
+			m_shards.push_back( shared_ptr<shard>(new shard(this, m_fdctx)) );
+		}
+		m_handlers = new handler_table(
+				m_shards[0]->get_kernel().max(), MP_WAVY_WORKER_MAX);
+		m_service = new volatile int[m_shards[0]->get_kernel().max()]();
+	} catch (...) {
+		delete m_handlers;
+		m_shards.clear();
+		out::free_fdctx(m_fdctx);
+		throw;
+	}
+
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		set_handler((*it)->get_out());
 	}
+
+	shared_ptr<timer_wheel> tw(new timer_wheel(this, get_kernel()));
+	set_handler(tw);
+	m_timer_wheel = tw.get();
 }
 
 loop_impl::~loop_impl()
 {
 	end();
 	join();  // FIXME detached?
-	{
-		pthread_scoped_lock lk(m_mutex);
-		m_cond.broadcast();
+	delete m_handlers;
+	delete[] m_service;
+	for(size_t i=0; i < m_ncontexts; ++i) {
+		delete m_contexts[i];
 	}
-	delete[] m_state;
+	m_shards.clear();
+	out::free_fdctx(m_fdctx);
 }
 
 void loop_impl::end()
 {
 	m_end_flag = true;
-	{
-		pthread_scoped_lock lk(m_mutex);
-		m_cond.broadcast();
-//		if(m_poll_thread) {  // FIXME signal_stop
-//			pthread_kill(m_poll_thread, SIGALRM);
-//		}
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		(*it)->wakeup();
 	}
+	pthread_scoped_lock lk(m_pool_mutex);
+	m_pool_cond.broadcast();
 }
 
 bool loop_impl::is_end() const
@@ -79,66 +359,593 @@ bool loop_impl::is_end() const
 }
 
 
+static void join_thread(pthread_thread& th)
+{
+	try {
+		th.join();
+	} catch (mp::pthread_error& e) {
+		if(e.code == EDEADLK) {
+			th.detach();
+		} else {
+			throw e;
+		}
+	}
+}
+
 void loop_impl::join()
 {
-	for(workers_t::iterator it(m_workers.begin());
-			it != m_workers.end(); ++it) {
-		try {
-			it->join();
-		} catch (mp::pthread_error& e) {
-			if(e.code == EDEADLK) {
-				it->detach();
-			} else {
-				throw e;
+	pthread_scoped_lock lk(m_pool_mutex);
+	if(m_scaler_running) {
+		pthread_thread scaler(m_scaler);
+		lk.unlock();
+		join_thread(scaler);
+		lk.relock(m_pool_mutex);
+		m_scaler_running = false;
+	}
+
+	// threads may be added or restarted while joining
+	while(true) {
+		worker* w = NULL;
+		size_t num = m_ncontexts;
+		for(size_t i=0; i < num; ++i) {
+			if(m_contexts[i]->is_joinable()) {
+				w = m_contexts[i];
+				break;
 			}
 		}
+		if(!w) { break; }
+
+		w->set_joinable(false);
+		pthread_thread th(w->thread());
+		lk.unlock();
+
+		join_thread(th);
+		__sync_sub_and_fetch(&m_nthreads, 1);
+
+		lk.relock(m_pool_mutex);
+	}
+}
+
+void loop_impl::detach()
+{
+	pthread_scoped_lock lk(m_pool_mutex);
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		worker* w = m_contexts[i];
+		if(w->is_joinable()) {
+			w->thread().detach();
+			w->set_joinable(false);
+		}
+	}
+}
+
+
+void loop_impl::start(size_t num)
+{
+	if(is_running()) {
+		// FIXME exception
+		throw std::runtime_error("loop is already running");
+	}
+	add_thread(num);
+}
+
+int loop_impl::cpu_of(size_t index) const
+{
+	if(m_placement.cpus.empty()) {
+		return -1;
+	}
+	return m_placement.cpus[index % m_placement.cpus.size()];
+}
+
+// called with m_pool_mutex locked
+void loop_impl::start_worker(worker* w)
+{
+	w->thread().run(bind(&loop_impl::thread_main, this, w));
+	w->set_joinable(true);
+	__sync_add_and_fetch(&m_nthreads, 1);
+}
+
+void loop_impl::add_thread(size_t num)
+{
+	pthread_scoped_lock lk(m_pool_mutex);
+	for(size_t i=0; i < num; ++i) {
+		size_t n = m_ncontexts;
+
+		// cancel a pending retirement first; the thread is still there
+		bool revived = false;
+		for(size_t j=0; j < n && !revived; ++j) {
+			revived = m_contexts[j]->set_state(
+					worker::STATE_RETIRING, worker::STATE_RUNNING);
+		}
+		if(revived) { continue; }
+
+		// then restart a retired worker on its context,
+		// which keeps its shard, index and epoch slot
+		worker* w = NULL;
+		for(size_t j=0; j < n; ++j) {
+			if(m_contexts[j]->state() == worker::STATE_EXITED) {
+				w = m_contexts[j];
+				break;
+			}
+		}
+		if(w) {
+			if(w->is_joinable()) {
+				// the thread has left its loop; this returns soon
+				w->set_joinable(false);
+				join_thread(w->thread());
+				__sync_sub_and_fetch(&m_nthreads, 1);
+			}
+			w->set_cpu(cpu_of(w->index()));
+			w->set_state(worker::STATE_EXITED, worker::STATE_RUNNING);
+			try {
+				start_worker(w);
+			} catch (...) {
+				w->set_state(worker::STATE_RUNNING, worker::STATE_EXITED);
+				throw;
+			}
+			continue;
+		}
+
+		if(n >= MP_WAVY_WORKER_MAX) {
+			throw std::runtime_error("too many worker threads");
+		}
+
+		// workers are assigned to shards in round-robin order
+		shard* s = m_shards[n % m_shards.size()].get();
+		w = new worker(s, m_handlers->worker_slot(n), n, cpu_of(n));
+
+		try {
+			start_worker(w);
+		} catch (...) {
+			delete w;
+			throw;
+		}
+
+		m_contexts[n] = w;
+		__sync_add_and_fetch(&m_ncontexts, 1);
+	}
+}
+
+void loop_impl::remove_thread(size_t num)
+{
+	pthread_scoped_lock lk(m_pool_mutex);
+
+	// every shard keeps at least one thread to poll its kernel
+	std::vector<size_t> alive(m_shards.size(), 0);
+	size_t n = m_ncontexts;
+	for(size_t i=0; i < n; ++i) {
+		if(m_contexts[i]->state() == worker::STATE_RUNNING) {
+			++alive[i % m_shards.size()];
+		}
+	}
+
+	// the newest threads go first
+	for(size_t i=n; i > 0 && num > 0; --i) {
+		worker* w = m_contexts[i-1];
+		size_t si = (i-1) % m_shards.size();
+		if(alive[si] > 1 && w->set_state(
+					worker::STATE_RUNNING, worker::STATE_RETIRING)) {
+			--alive[si];
+			--num;
+		}
+	}
+	lk.unlock();
+
+	// retiring threads exit when they look for the next work
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		(*it)->wakeup();
+	}
+}
+
+size_t loop_impl::num_threads() const
+{
+	size_t result = 0;
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		if(m_contexts[i]->state() == worker::STATE_RUNNING) {
+			++result;
+		}
+	}
+	return result;
+}
+
+bool loop_impl::is_running() const
+{
+	return m_nthreads != 0;
+}
+
+void loop_impl::set_autoscale(size_t min_threads, size_t max_threads,
+		double interval_sec)
+{
+	if(min_threads < 1) {
+		min_threads = 1;
+	}
+	if(max_threads < min_threads) {
+		throw std::invalid_argument("max_threads must not be less than min_threads");
+	}
+	if(interval_sec <= 0.0) {
+		throw std::invalid_argument("autoscale interval must be positive");
+	}
+
+	pthread_scoped_lock lk(m_pool_mutex);
+	m_scale_min = min_threads;
+	m_scale_max = max_threads;
+	m_scale_interval = interval_sec;
+	m_scale_busy = 0;
+	m_scale_idle = 0;
+
+	if(!m_scaler_running) {
+		m_scaler.run(bind(&loop_impl::scaler_main, this));
+		m_scaler_running = true;
+	} else {
+		m_pool_cond.broadcast();
+	}
+}
+
+// the autoscaler has its own thread: while every worker is
+// blocked in a long task, no worker would run a timer for it
+void loop_impl::scaler_main()
+{
+	char name[64];
+	snprintf(name, sizeof(name), "%s-scale", m_placement.name.c_str());
+	name_thread(name);
+
+	pthread_scoped_lock lk(m_pool_mutex);
+	while(!is_end()) {
+		struct timespec abstime;
+		clock_gettime(CLOCK_REALTIME, &abstime);
+		double sec = m_scale_interval;
+		abstime.tv_sec += (time_t)sec;
+		abstime.tv_nsec += (long)((sec - (double)(time_t)sec) * 1e9);
+		if(abstime.tv_nsec >= 1000000000) {
+			abstime.tv_sec += 1;
+			abstime.tv_nsec -= 1000000000;
+		}
+		m_pool_cond.timedwait(m_pool_mutex, &abstime);
+		if(is_end()) { break; }
+
+		lk.unlock();
+		autoscale_tick();
+		lk.relock(m_pool_mutex);
+	}
+}
+
+void loop_impl::autoscale_tick()
+{
+	size_t queued = 0;
+	int parked = 0;
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		queued += (*it)->queued();
+		parked += (*it)->sleeping();
+	}
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		queued += m_contexts[i]->size();
+	}
+
+	size_t threads = num_threads();
+	if(threads == 0) {
+		return;  // not started, or a single-threaded run_once loop
+	}
+
+	if(queued > threads) {
+		++m_scale_busy;
+		m_scale_idle = 0;
+	} else if(parked > 0) {
+		++m_scale_idle;
+		m_scale_busy = 0;
+	} else {
+		m_scale_busy = 0;
+		m_scale_idle = 0;
+	}
+
+	if(threads < m_scale_min ||
+			(m_scale_busy >= MP_WAVY_AUTOSCALE_GROW_SAMPLES &&
+			 threads < m_scale_max)) {
+		add_thread(1);
+		m_scale_busy = 0;
+	} else if(threads > m_scale_max ||
+			(m_scale_idle >= MP_WAVY_AUTOSCALE_SHRINK_SAMPLES &&
+			 threads > m_scale_min)) {
+		remove_thread(1);
+		m_scale_idle = 0;
+	}
+}
+
+void loop_impl::set_placement(const loop::placement& pl)
+{
+	m_placement = pl;
+}
+
+std::vector<int> loop_impl::worker_cpus() const
+{
+	std::vector<int> result;
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		result.push_back(m_contexts[i]->cpu());
+	}
+	return result;
+}
+
+void loop_impl::thread_main(worker* self)
+{
+	// pin the thread before thread_init_func allocates memory,
+	// so that it comes from the node of the CPU
+	if(self->cpu() >= 0 && pin_thread(self->cpu()) != 0) {
+		self->set_cpu(-1);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s-%lu",
+			m_placement.name.c_str(), (unsigned long)self->index());
+	name_thread(name);
+
+	s_current_worker = self;
+	if(m_thread_init_func) {
+		m_thread_init_func();
+	}
+	self->get_shard()->thread_main(self);
+}
+
+void loop_impl::submit_impl(task_t& f)
+{
+	// tasks submitted from a worker thread stay on its local deque
+	worker* w = s_current_worker;
+	if(w != NULL && w->get_shard()->get_loop() == this) {
+		w->push(f);
+		if(w->size() > 1) {
+			// more than the worker runs next; let an idle one steal
+			w->get_shard()->wakeup_one();
+		}
+		return;
+	}
+
+	shard* s = m_shards[__sync_fetch_and_add(&m_rr, 1) % m_shards.size()].get();
+	s->submit_impl(f);
+}
+
+void loop_impl::submit_impl(loop::priority prio, task_t& f)
+{
+	if(prio == loop::PRIORITY_NORMAL) {
+		submit_impl(f);
+		return;
+	}
+
+	// high and low priority tasks bypass the local deques,
+	// which are run in FIFO order; keep them on the worker's shard
+	shard* s;
+	worker* w = s_current_worker;
+	if(w != NULL && w->get_shard()->get_loop() == this) {
+		s = w->get_shard();
+	} else {
+		s = m_shards[__sync_fetch_and_add(&m_rr, 1) % m_shards.size()].get();
+	}
+	s->submit_impl(prio, f);
+}
+
+void loop_impl::submit_bulk(task_t* tasks, size_t num)
+{
+	worker* w = s_current_worker;
+	if(w != NULL && w->get_shard()->get_loop() == this) {
+		w->push_bulk(tasks, num);
+		size_t queued = w->size();
+		if(queued > 1) {
+			// the worker runs one next; the rest are for thieves
+			w->get_shard()->wakeup_some(queued - 1);
+		}
+		return;
+	}
+
+	// split the tasks evenly among the shards
+	size_t nshards = m_shards.size();
+	size_t base = __sync_fetch_and_add(&m_rr, nshards);
+	size_t off = 0;
+	for(size_t i=0; i < nshards && off < num; ++i) {
+		size_t n = (num - off) / (nshards - i);
+		if(n == 0) { n = 1; }
+		m_shards[(base + i) % nshards]->submit_bulk(tasks + off, n);
+		off += n;
+	}
+}
+
+worker* loop_impl::steal_task(worker* self, task_t* f)
+{
+	size_t num = m_ncontexts;
+	if(num <= 1) {
+		return NULL;
+	}
+	// start scanning from a different victim on every steal
+	size_t base = __sync_fetch_and_add(&m_rr, 1);
+	for(size_t i=0; i < num; ++i) {
+		worker* w = m_contexts[(base + i) % num];
+		if(w != self && w->pop(f)) {
+			return w;
+		}
+	}
+	return NULL;
+}
+
+bool loop_impl::has_local_task(shard* s) const
+{
+	size_t num = m_ncontexts;
+	for(size_t i=0; i < num; ++i) {
+		worker* w = m_contexts[i];
+		if(w->get_shard() == s && (!w->empty() || w->running())) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void shard::submit_impl(task_t& f)
+{
+	m_task_queue.push(f);
+	m_loop->local_stats().max(stat_counters::TASK_QUEUE_MAX,
+			m_task_queue.size());
+	wakeup_one();
+}
+
+void shard::submit_impl(loop::priority prio, task_t& f)
+{
+	task_queue_t* queue = &m_task_queue;
+	if(prio == loop::PRIORITY_HIGH) {
+		queue = &m_high_queue;
+	} else if(prio == loop::PRIORITY_LOW) {
+		queue = &m_low_queue;
+	}
+	queue->push(f);
+	m_loop->local_stats().max(stat_counters::TASK_QUEUE_MAX,
+			queue->size());
+	wakeup_one();
+}
+
+void shard::submit_bulk(task_t* tasks, size_t num)
+{
+	for(size_t i=0; i < num; ++i) {
+		m_task_queue.push(tasks[i]);
+	}
+	m_loop->local_stats().max(stat_counters::TASK_QUEUE_MAX,
+			m_task_queue.size());
+	wakeup_some(num);
+}
+
+bool shard::has_task() const
+{
+	return !m_high_queue.empty() || !m_task_queue.empty() ||
+		!m_low_queue.empty();
+}
+
+void shard::wakeup_one()
+{
+	// take the lock only if a worker is sleeping on m_cond.
+	// pairs with the increment of m_sleeping in park().
+	// spinning workers see the bumped sequence.
+	__sync_add_and_fetch(&m_wake_seq, 1);
+	if(m_sleeping > 0) {
+		pthread_scoped_lock lk(m_mutex);
+		m_cond.signal();
+	} else {
+		poke();
+	}
+}
+
+// wakes up to num sleeping threads with one lock acquisition.
+// the poller is poked if there are fewer sleepers than tasks.
+void shard::wakeup_some(size_t num)
+{
+	__sync_add_and_fetch(&m_wake_seq, 1);
+	if(m_sleeping > 0) {
+		pthread_scoped_lock lk(m_mutex);
+		size_t n = 0;
+		for(; n < num && n < (size_t)m_sleeping; ++n) {
+			m_cond.signal();
+		}
+		if(n < num) {
+			poke();
+		}
+	} else {
+		poke();
+	}
+}
+
+// makes the thread blocking in the kernel return.
+// writes the wakeup event once per blocking wait.
+void shard::poke()
+{
+	if(m_poll_blocked &&
+			__sync_bool_compare_and_swap(&m_poll_blocked, 1, 0)) {
+		kernel::signal_wakeup(&m_wakeup);
+	}
+}
+
+// seq is m_wake_seq sampled when the caller decided to block.
+// work signaled after that is not left waiting for the timeout.
+int shard::wait_kernel(int timeout, unsigned int seq)
+{
+	int num;
+	if(timeout == 0) {
+		num = m_kernel.wait(&m_backlog, 0);
+	} else {
+		// pairs with the bump of m_wake_seq before poke()
+		__sync_lock_test_and_set(&m_poll_blocked, 1);
+		MP_WAVY_FENCE();
+		if(m_wake_seq != seq) {
+			timeout = 0;
+		}
+
+		num = m_kernel.wait(&m_backlog, timeout);
+		m_poll_blocked = 0;
+	}
+
+	stat_counters& st(m_loop->local_stats());
+	st.add(stat_counters::POLLS, 1);
+	if(num > 0) {
+		st.add(stat_counters::POLLED, num);
+		st.max(stat_counters::POLL_BATCH_MAX, num);
 	}
-	m_workers.clear();
+	return num;
 }
 
-void loop_impl::detach()
+void shard::notify_flush()
 {
-	for(workers_t::iterator it(m_workers.begin());
-			it != m_workers.end(); ++it) {
-		it->detach();
+	MP_WAVY_FENCE();
+	if(m_flushing > 0) {
+		pthread_scoped_lock lk(m_mutex);
+		m_flush_cond.broadcast();
 	}
 }
 
-
-void loop_impl::start(size_t num)
+static inline void run_task(task& f, stat_counters& st)
 {
-	pthread_scoped_lock lk(m_mutex);
-	if(is_running()) {
-		// FIXME exception
-		throw std::runtime_error("loop is already running");
-	}
-	add_thread(num);
+	try {
+		f();
+	} catch (...) { }
+	st.add(stat_counters::TASKS, 1);
 }
 
-void loop_impl::add_thread(size_t num)
+// called with m_mutex locked
+void shard::notify()
 {
-	for(size_t i=0; i < num; ++i) {
-		m_workers.push_back( pthread_thread() );
-		try {
-			m_workers.back().run(
-					bind(&loop_impl::thread_main, this));
-		} catch (...) {
-			m_workers.pop_back();
-			throw;
-		}
+	__sync_add_and_fetch(&m_wake_seq, 1);
+	if(m_sleeping > 0) {
+		m_cond.signal();
+	} else {
+		poke();
 	}
 }
 
-bool loop_impl::is_running() const
+void shard::park(pthread_scoped_lock& lk)
 {
-	return !m_workers.empty();
-}
+	size_t spin = m_loop->get_idle_spin();
+	size_t yield = m_loop->get_idle_yield();
 
-void loop_impl::submit_impl(task_t& f)
-{
-	pthread_scoped_lock lk(m_mutex);
-	m_task_queue.push(f);
-	m_cond.signal();
+	if(spin > 0 || yield > 0) {
+		unsigned int seq = m_wake_seq;
+		lk.unlock();
+
+		size_t i = 0;
+		for(; i < spin + yield; ++i) {
+			if(m_wake_seq != seq || m_loop->is_end()) { break; }
+			if(i < spin) {
+				MP_WAVY_CPU_RELAX();
+			} else {
+				sched_yield();
+			}
+		}
+
+		lk.relock(m_mutex);
+		if(i < spin + yield || m_wake_seq != seq) {
+			return;
+		}
+	}
+
+	__sync_add_and_fetch(&m_sleeping, 1);
+	if(!has_task()) {
+		m_cond.wait(m_mutex);
+	}
+	__sync_sub_and_fetch(&m_sleeping, 1);
 }
 
 
@@ -149,8 +956,23 @@ shared_ptr<basic_handler> loop_impl::add_handler_impl(shared_ptr<basic_handler>
 		throw system_error(errno, "failed to set nonblock flag");
 	}
 
+	short ev = sh->is_write_event() ? EVKERNEL_WRITE : EVKERNEL_READ;
+
 	set_handler(sh);
-	get_kernel().add_fd(fd, EVKERNEL_READ);
+	kernel& kern(shard_of(fd).get_kernel());
+#ifdef MP_WAVY_KERNEL_RECV
+	// falls back to a poll if the kernel doesn't support it
+	if(sh->is_recv_buffered() && kern.add_fd_recv(fd) == 0) {
+		return sh;
+	} else if(sh->is_accept_event() && kern.add_fd_accept(fd) == 0) {
+		return sh;
+	}
+#endif
+	if(sh->is_edge_triggered()) {
+		kern.add_fd_edge(fd, ev);
+	} else {
+		kern.add_fd(fd, ev);
+	}
 
 	return sh;
 }
@@ -158,31 +980,55 @@ shared_ptr<basic_handler> loop_impl::add_handler_impl(shared_ptr<basic_handler>
 void loop_impl::remove_handler(int fd)
 {
 	reset_handler(fd);
-	m_kernel.remove_fd(fd, EVKERNEL_READ);
+	shard_of(fd).get_kernel().remove_fd(fd, EVKERNEL_READ);
 }
 
 
-void loop_impl::do_task(pthread_scoped_lock& lk)
+void shard::do_task(pthread_scoped_lock& lk, task_queue_t& queue)
 {
-	task_t ev = m_task_queue.front();
-	m_task_queue.pop();
+	task_t ev;
+	// counted before the pop so that flush() never sees
+	// an empty queue while the task is still running
+	__sync_add_and_fetch(&m_running, 1);
+	if(!queue.pop(&ev)) {
+		__sync_sub_and_fetch(&m_running, 1);
+		return;
+	}
 
-	bool last = m_task_queue.empty();
-	if(!last) { m_cond.signal(); }
+	if(!queue.empty()) { notify(); }
 
 	lk.unlock();
 
-	try {
-		ev();
-	} catch (...) { }
+	run_task(ev, m_loop->local_stats());
 
-	if(last) {
-		lk.relock(m_mutex);
-		m_flush_cond.broadcast();
+	if(__sync_sub_and_fetch(&m_running, 1) == 0 && !has_task()) {
+		notify_flush();
+	}
+}
+
+// called with m_mutex locked.
+// returns true if the worker is retired and leaves the loop.
+bool shard::retire(worker* self)
+{
+	if(self->state() != worker::STATE_RETIRING || !self->empty()) {
+		return false;
+	}
+	if(!self->set_state(worker::STATE_RETIRING, worker::STATE_EXITED)) {
+		return false;  // revived by add_thread
 	}
+	// the backlog and the queues are left to the other threads
+	notify();
+	return true;
+}
+
+size_t shard::queued()
+{
+	pthread_scoped_lock lk(m_mutex);
+	return m_task_queue.size() + m_high_queue.size() + m_low_queue.size() +
+		m_more_queue.size() + m_yield_queue.size() + (m_num - m_off);
 }
 
-void loop_impl::do_out(pthread_scoped_lock& lk)
+void shard::do_out(pthread_scoped_lock& lk)
 {
 	kernel::event ke = m_out->next();
 
@@ -194,21 +1040,38 @@ void loop_impl::do_out(pthread_scoped_lock& lk)
 	}
 }
 
-void loop_impl::thread_main()
+void shard::thread_main(worker* self)
 {
 	retry:
 	while(true) {
+		// run tasks submitted from this worker first, while their data
+		// is still hot in this core's cache
+		for(int i=0; i < MP_WAVY_TASK_QUEUE_LIMIT; ++i) {
+			task_t t;
+			if(!m_high_queue.empty()) { break; }
+			if(!self->pop(&t)) { break; }
+			run_task(t, self->stats());
+			self->done();
+		}
+
 		pthread_scoped_lock lk(m_mutex);
 
 		retry_task:
-		if(m_end_flag) { break; }
+		if(m_loop->is_end()) { break; }
+		if(retire(self)) { break; }
 
 		kernel::event ke;
 
+		if(!m_high_queue.empty()) {
+			do_task(lk, m_high_queue);
+			goto retry;
+		}
+
 		if(!m_more_queue.empty()) {
 			ke = m_more_queue.front();
 			m_more_queue.pop();
-			goto process_handler;
+			dispatch(ke, lk);
+			goto retry;
 		}
 
 		if(!m_pollable) {
@@ -216,32 +1079,80 @@ void loop_impl::thread_main()
 				do_out(lk);
 				goto retry;
 			} else if(!m_task_queue.empty()) {
-				do_task(lk);
+				do_task(lk, m_task_queue);
+				goto retry;
+			} else if(!self->empty()) {
 				goto retry;
 			} else {
-				m_cond.wait(m_mutex);
+				task_t t;
+				worker* victim = m_loop->steal_task(self, &t);
+				if(victim) {
+					lk.unlock();
+					run_task(t, self->stats());
+					victim->done();
+					goto retry;
+				}
+				if(!m_low_queue.empty()) {
+					do_task(lk, m_low_queue);
+					goto retry;
+				}
+				park(lk);
 				goto retry_task;
 			}
 		} else if(m_task_queue.size() > MP_WAVY_TASK_QUEUE_LIMIT) {
-			do_task(lk);
+			do_task(lk, m_task_queue);
+			goto retry;
+		} else if(!m_low_queue.empty() &&
+				++m_low_turn % MP_WAVY_TASK_LOW_INTERVAL == 0) {
+			do_task(lk, m_low_queue);
 			goto retry;
 		}
 
 		if(m_num == m_off) {
+			// don't block in the kernel while queued work is waiting;
+			// a shard may have no other thread to take it.
+			int timeout = 1000;
+			unsigned int seq = m_wake_seq;
+			if(has_task() || m_out->has_queue() || !self->empty() ||
+					!m_yield_queue.empty()) {
+				timeout = 0;
+			} else {
+				task_t t;
+				worker* victim = m_loop->steal_task(self, &t);
+				if(victim) {
+					lk.unlock();
+					run_task(t, self->stats());
+					victim->done();
+					goto retry;
+				}
+			}
+
 			m_pollable = false;
-//m_poll_thread = pthread_self();  // FIXME signal_stop
 			lk.unlock();
 
-			retry_poll:
-			int num = m_kernel.wait(&m_backlog, 1000);
+			if(timeout > 0 && m_loop->get_handlers().has_retired()) {
+				m_loop->get_handlers().reclaim();
+			}
+
+			int num = wait_kernel(timeout, seq);
 
 			if(num <= 0) {
 				if(num == 0 || errno == EINTR || errno == EAGAIN) {
-					if(m_end_flag) {
+					if(m_loop->is_end()) {
 						m_pollable = true;
 						break;
 					}
-					goto retry_poll;
+					lk.relock(m_mutex);
+					m_pollable = true;
+					requeue_yielded();
+					if(m_out->has_queue()) {
+						do_out(lk);
+					} else if(!m_task_queue.empty()) {
+						do_task(lk, m_task_queue);
+					} else if(!m_low_queue.empty()) {
+						do_task(lk, m_low_queue);
+					}
+					goto retry;
 				} else {
 					throw system_error(errno, "wavy kernel event failed");
 				}
@@ -250,75 +1161,193 @@ void loop_impl::thread_main()
 			lk.relock(m_mutex);
 			m_off = 0;
 			m_num = num;
+			m_polled_at = MP_WAVY_LATENCY_NOW();
+			requeue_yielded();
 
-//m_poll_thread = 0;  // FIXME signal_stop
 			m_pollable = true;
-			m_cond.signal();
+			notify();
 		}
 
-		ke = m_backlog[m_off++];
-
-		process_handler:
-		int ident = ke.ident();
+		size_t batch = m_loop->get_dispatch_batch();
+		self->stats().add(stat_counters::CLAIMS, 1);
+		if(batch <= 1) {
+			ke = m_backlog[m_off++];
+			dispatch(ke, lk, m_polled_at);
+			continue;
+		}
 
-		if(ident == m_out->ident()) {
-			m_out->poll_event();
+		// claim a slice of the backlog with one lock acquisition
+		{
+			kernel::event* slice = self->slice();
+			size_t n = 0;
+			while(n < batch && m_off < m_num) {
+				slice[n++] = m_backlog[m_off++];
+			}
+			if(m_off < m_num) {
+				notify();
+			}
+			uint64_t polled_at = m_polled_at;
 			lk.unlock();
 
-			m_kernel.reactivate(ke);
+			for(size_t i=0; i < n; ++i) {
+				dispatch(slice[i], lk, polled_at);
+			}
+		}
 
-		} else {
-			lk.unlock();
+	}  // while(true)
+}
 
-			event_impl e(this, ke);
-			shared_handler h = m_state[ident];
+void shard::dispatch(kernel::event ke, pthread_scoped_lock& lk,
+		uint64_t polled_at)
+{
+	int ident = ke.ident();
 
-			bool cont = false;
-			if(h) {
-				try {
-					cont = (*h)(e);
-				} catch (...) { }
-			}
+	if(ident == m_wakeup.ident()) {
+		lk.unlock();
+		kernel::read_wakeup(ke);
+		m_kernel.reactivate(ke);
+		return;
+	}
 
-			if(!e.is_reactivated()) {
-				if(e.is_removed()) {
-					goto retry;
-				}
-				if(!cont) {
-					m_kernel.remove(ke);
-					reset_handler(ident);
-					goto retry;
-				}
-				m_kernel.reactivate(ke);
-			}
+	if(ident == m_out->ident()) {
+		if(!lk.owns()) {
+			lk.relock(m_mutex);
 		}
+		m_out->poll_event();
+		lk.unlock();
 
-	}  // while(true)
+		m_kernel.reactivate(ke);
+		return;
+	}
+
+	lk.unlock();
+
+	if(!ke.edge_triggered()) {
+		call_handler(ke, polled_at);
+		return;
+	}
+
+	if(!m_loop->enter_service(ident)) {
+		return;  // the thread in service runs the handler again
+	}
+	do {
+		if(!call_handler(ke, polled_at)) {
+			return;
+		}
+		polled_at = 0;  // runs again for an event that arrived in service
+	} while(!m_loop->leave_service(ident));
+}
+
+// returns false if the handler is removed
+bool shard::call_handler(kernel::event ke, uint64_t polled_at)
+{
+#ifndef ENABLE_HANDLER_LATENCY
+	(void)polled_at;  // always 0
+#endif
+	int ident = ke.ident();
+
+	handler_table& table(m_loop->get_handlers());
+	handler_pin pin(m_loop);
+
+	event_impl e(this, ke,
+			m_loop->get_more_budget(), m_loop->get_read_budget());
+	handler_table::entry* h = table.get(ident);
+
+	bool cont = false;
+	while(h) {
+#ifdef ENABLE_HANDLER_LATENCY
+		uint64_t started = latency_clock();
+#endif
+		try {
+			cont = (*h->handler)(e);
+		} catch (...) { }
+#ifdef ENABLE_HANDLER_LATENCY
+		m_loop->local_latency().record(typeid(*h->handler),
+				polled_at, started, latency_clock());
+#endif
+		m_loop->local_stats().add(stat_counters::EVENTS, 1);
+
+		// event::more() within the budget runs the handler again
+		// here, while the buffers of the connection are in cache
+		if(!e.is_continued()) {
+			break;
+		}
+		e.next_turn();
+#ifdef ENABLE_HANDLER_LATENCY
+		polled_at = 0;
+#endif
+	}
+
+	if(!e.is_reactivated()) {
+		if(e.is_removed()) {
+			return false;
+		}
+		if(!cont) {
+			m_kernel.remove(ke);
+			m_loop->reset_handler(ident, h);
+			return false;
+		}
+		if(e.exhausted()) {
+			// the handler used up its budget and may have left
+			// data unread
+			event_yield(ke);
+		} else {
+			m_kernel.reactivate(ke);
+		}
+	}
+	return true;
+}
+
+
+void loop_impl::set_dispatch_batch(size_t num)
+{
+	if(num < 1) {
+		num = 1;
+	} else if(num > MP_WAVY_KERNEL_BACKLOG_SIZE) {
+		num = MP_WAVY_KERNEL_BACKLOG_SIZE;
+	}
+	m_dispatch_batch = num;
+}
+
+
+void loop_impl::run_once()
+{
+	m_shards[__sync_fetch_and_add(&m_rr, 1) % m_shards.size()]->run_once();
 }
 
+void loop_impl::run_nonblock()
+{
+	m_shards[__sync_fetch_and_add(&m_rr, 1) % m_shards.size()]->run_nonblock();
+}
 
-inline void loop_impl::run_once()
+inline void shard::run_once()
 {
 	pthread_scoped_lock lk(m_mutex);
 	run_once(lk, true);
 }
 
-inline void loop_impl::run_nonblock()
+inline void shard::run_nonblock()
 {
 	pthread_scoped_lock lk(m_mutex);
 	run_once(lk, false);
 }
 
-void loop_impl::run_once(pthread_scoped_lock& lk, bool block)
+void shard::run_once(pthread_scoped_lock& lk, bool block)
 {
-	if(m_end_flag) { return; }
+	if(m_loop->is_end()) { return; }
 
 	kernel::event ke;
 
+	if(!m_high_queue.empty()) {
+		do_task(lk, m_high_queue);
+		return;
+	}
+
 	if(!m_more_queue.empty()) {
 		ke = m_more_queue.front();
 		m_more_queue.pop();
-		goto process_handler;
+		dispatch(ke, lk);
+		return;
 	}
 
 	if(!m_pollable) {
@@ -326,13 +1355,15 @@ void loop_impl::run_once(pthread_scoped_lock& lk, bool block)
 		if(m_out->has_queue()) {
 			do_out(lk);
 		} else if(!m_task_queue.empty()) {
-			do_task(lk);
+			do_task(lk, m_task_queue);
+		} else if(!m_low_queue.empty()) {
+			do_task(lk, m_low_queue);
 		} else if(block) {
-			m_cond.wait(m_mutex);
+			park(lk);
 		}
 		return;
 	} else if(!m_task_queue.empty()) {
-		do_task(lk);
+		do_task(lk, m_task_queue);
 		return;
 	} else if(m_out->has_queue()) {
 		do_out(lk);  // FIXME
@@ -340,15 +1371,25 @@ void loop_impl::run_once(pthread_scoped_lock& lk, bool block)
 	}
 
 	if(m_num == m_off) {
+		unsigned int seq = m_wake_seq;
+		bool yielded = !m_yield_queue.empty();  // read under the lock
+		bool queued = has_task();
 		m_pollable = false;
 		lk.unlock();
 
-		int num = m_kernel.wait(&m_backlog, block ? 1000 : 0);
+		int num = wait_kernel((block && !queued && !yielded) ? 1000 : 0, seq);
 
 		if(num <= 0) {
 			if(num == 0 || errno == EINTR || errno == EAGAIN) {
+				if(yielded) {
+					lk.relock(m_mutex);
+					requeue_yielded();
+					m_pollable = true;
+					return;
+				}
+				lk.relock(m_mutex);
 				m_pollable = true;
-				if(!block) {
+				if(!block || has_task()) {
 					goto do_queue;
 				}
 				return;
@@ -360,55 +1401,34 @@ void loop_impl::run_once(pthread_scoped_lock& lk, bool block)
 		lk.relock(m_mutex);
 		m_off = 0;
 		m_num = num;
+		m_polled_at = MP_WAVY_LATENCY_NOW();
+		requeue_yielded();
 
 		m_pollable = true;
-		m_cond.signal();
+		notify();
 	}
 
+	m_loop->local_stats().add(stat_counters::CLAIMS, 1);
 	ke = m_backlog[m_off++];
+	dispatch(ke, lk, m_polled_at);
+}
 
-	process_handler:
-	int ident = ke.ident();
-
-	if(ident == m_out->ident()) {
-		m_out->poll_event();
-		lk.unlock();
-
-		m_kernel.reactivate(ke);
-
-	} else {
-		lk.unlock();
-
-		event_impl e(this, ke);
-		shared_handler h = m_state[ident];
-
-		bool cont = false;
-		if(h) {
-			try {
-				cont = (*h)(e);
-			} catch (...) { }
-		}
 
-		if(!e.is_reactivated()) {
-			if(e.is_removed()) {
-				return;
-			}
-			if(!cont) {
-				m_kernel.remove(ke);
-				reset_handler(ident);
-				return;
-			}
-			m_kernel.reactivate(ke);
-		}
+void loop_impl::flush()
+{
+	for(shards_t::iterator it(m_shards.begin());
+			it != m_shards.end(); ++it) {
+		(*it)->flush();
 	}
 }
 
-
-void loop_impl::flush()
+void shard::flush()
 {
 	pthread_scoped_lock lk(m_mutex);
-	while(!m_out->empty() || !m_task_queue.empty()) {
-		if(is_running()) {
+	__sync_add_and_fetch(&m_flushing, 1);
+	while(!m_out->empty() || has_task() || m_running != 0 ||
+			m_loop->has_local_task(this)) {
+		if(m_loop->is_running()) {
 			m_flush_cond.wait(m_mutex);
 		} else {
 			run_once(lk);
@@ -417,25 +1437,48 @@ void loop_impl::flush()
 			}
 		}
 	}
+	__sync_sub_and_fetch(&m_flushing, 1);
 }
 
 
-void loop_impl::event_more(kernel::event ke)
+void shard::event_more(kernel::event ke)
 {
+	m_loop->local_stats().add(stat_counters::MORE, 1);
 	pthread_scoped_lock lk(m_mutex);
 	m_more_queue.push(ke);
-	m_cond.signal();
+	notify();
+}
+
+void shard::event_yield(kernel::event ke)
+{
+	m_loop->local_stats().add(stat_counters::BUDGET_REQUEUE, 1);
+	pthread_scoped_lock lk(m_mutex);
+	m_yield_queue.push(ke);
+	// the poller takes it after the next wait
+	__sync_add_and_fetch(&m_wake_seq, 1);
+	poke();
+}
+
+// called with m_mutex locked after a kernel wait. the events which used
+// up their budget run once per wait, so that the other ready fds get
+// their turn in between.
+void shard::requeue_yielded()
+{
+	while(!m_yield_queue.empty()) {
+		m_more_queue.push(m_yield_queue.front());
+		m_yield_queue.pop();
+	}
 }
 
-void loop_impl::event_next(kernel::event ke)
+void shard::event_next(kernel::event ke)
 {
 	m_kernel.reactivate(ke);
 }
 
-void loop_impl::event_remove(kernel::event ke)
+void shard::event_remove(kernel::event ke)
 {
 	m_kernel.remove(ke);
-	reset_handler(ke.ident());
+	m_loop->reset_handler(ke.ident());
 }
 
 
@@ -446,16 +1489,105 @@ void event::more()
 {
 	event_impl* self = static_cast<event_impl*>(this);
 	if(!self->is_reactivated()) {
-		self->m_loop->event_more(self->m_pe);
-		self->m_flags |= 0x01;
+		if(self->m_more_left > 0 && !self->exhausted()) {
+			--self->m_more_left;
+			self->m_flags |= event_impl::FLAG_REACTIVATED |
+				event_impl::FLAG_CONTINUED;
+		} else {
+			self->m_shard->event_more(self->m_pe);
+			self->m_flags |= event_impl::FLAG_REACTIVATED;
+		}
+	}
+}
+
+void event::consume(size_t amount)
+{
+	event_impl* self = static_cast<event_impl*>(this);
+	if(self->m_budget != event_impl::NO_BUDGET) {
+		self->m_budget = (amount < self->m_budget) ?
+			self->m_budget - amount : 0;
+	}
+}
+
+size_t event::budget() const
+{
+	return static_cast<const event_impl*>(this)->m_budget;
+}
+
+bool event::exhausted() const
+{
+	return budget() == 0;
+}
+
+ssize_t event::recv(recv_buffer* buf)
+{
+	event_impl* self = static_cast<event_impl*>(this);
+	const kernel::event& ke(self->get_kernel_event());
+#ifdef MP_WAVY_KERNEL_RECV
+	if(ke.is_recv()) {
+		kernel::received* r = self->m_shard->get_kernel().take(ke.ident());
+		if(!r) {
+			errno = EAGAIN;
+			return -1;
+		}
+		int res = r->res;
+		if(res <= 0) {
+			kernel::free_received(r);
+			if(res < 0) {
+				errno = -res;
+				return -1;
+			}
+			return 0;
+		}
+		buf->reset(&r->block, r->buf, res);
+		return res;
+	}
+#endif
+	recv_buffer::block* b = (recv_buffer::block*)::malloc(
+			sizeof(recv_buffer::block) + MP_WAVY_RECV_BUFFER_SIZE);
+	if(!b) {
+		throw std::bad_alloc();
+	}
+	char* data = (char*)(b + 1);
+	ssize_t rl = ::read(ke.ident(), data, MP_WAVY_RECV_BUFFER_SIZE);
+	if(rl <= 0) {
+		::free(b);
+		return rl;
 	}
+	b->count = 1;
+	b->release = &free_recv_block;
+	buf->reset(b, data, rl);
+	return rl;
+}
+
+int event::accept()
+{
+	event_impl* self = static_cast<event_impl*>(this);
+	const kernel::event& ke(self->get_kernel_event());
+#ifdef MP_WAVY_KERNEL_RECV
+	if(ke.is_accept()) {
+		kernel::received* r = self->m_shard->get_kernel().take(ke.ident());
+		if(!r) {
+			errno = EAGAIN;
+			return -1;
+		}
+		int res = r->res;
+		kernel::free_received(r);
+		if(res < 0) {
+			errno = -res;
+			return -1;
+		}
+		return res;
+	}
+#endif
+	return ::accept(ke.ident(), NULL, NULL);
 }
 
 void event::next()
 {
 	event_impl* self = static_cast<event_impl*>(this);
 	if(!self->is_reactivated()) {
-		self->m_loop->event_next(self->m_pe);
+		self->m_shard->event_next(self->m_pe);
 		self->m_flags |= event_impl::FLAG_REACTIVATED;
 	}
 }
@@ -464,7 +1596,7 @@ void event::remove()
 {
 	event_impl* self = static_cast<event_impl*>(this);
 	if(!self->is_removed()) {
-		self->m_loop->event_remove(self->m_pe);
+		self->m_shard->event_remove(self->m_pe);
 		self->m_flags |= event_impl::FLAG_REMOVED;
 	}
 }
@@ -472,6 +1604,15 @@ void event::remove()
 
 loop::loop() : m_impl(new loop_impl()) { }
 
+loop::loop(function<void ()> thread_init_func) :
+	m_impl(new loop_impl(thread_init_func)) { }
+
+loop::loop(sharded sh) :
+	m_impl(new loop_impl(sh.num)) { }
+
+loop::loop(sharded sh, function<void ()> thread_init_func) :
+	m_impl(new loop_impl(sh.num, thread_init_func)) { }
+
 loop::~loop() { delete ANON_impl; }
 
 void loop::run(size_t num)
@@ -483,6 +1624,22 @@ void loop::run(size_t num)
 void loop::start(size_t num)
 	{ ANON_impl->start(num); }
 
+void loop::start(size_t num, const placement& pl)
+{
+	ANON_impl->set_placement(pl);
+	ANON_impl->start(num);
+}
+
+std::vector<int> loop::worker_cpus() const
+	{ return ANON_impl->worker_cpus(); }
+
+loop::placement loop::placement::per_core(int node)
+{
+	placement pl;
+	core_cpus(node, &pl.cpus);
+	return pl;
+}
+
 bool loop::is_running() const
 	{ return ANON_impl->is_running(); }
 
@@ -507,15 +1664,74 @@ void loop::detach()
 void loop::add_thread(size_t num)
 	{ ANON_impl->add_thread(num); }
 
+void loop::remove_thread(size_t num)
+	{ ANON_impl->remove_thread(num); }
+
+size_t loop::num_threads() const
+	{ return ANON_impl->num_threads(); }
+
+void loop::set_autoscale(autoscale policy)
+{
+	ANON_impl->set_autoscale(policy.min_threads, policy.max_threads,
+			policy.interval_sec);
+}
+
+void loop::set_dispatch_batch(size_t num)
+	{ ANON_impl->set_dispatch_batch(num); }
+
+void loop::set_more_budget(size_t num)
+	{ ANON_impl->set_more_budget(num); }
+
+void loop::set_read_budget(size_t amount)
+	{ ANON_impl->set_read_budget(amount); }
+
+void loop::set_idle_policy(idle_policy policy)
+	{ ANON_impl->set_idle_policy(policy.spin, policy.yield); }
+
+loop::statistics loop::stats() const
+	{ return ANON_impl->stats(); }
+
+std::vector<loop::handler_latency> loop::handler_latencies() const
+	{ return ANON_impl->handler_latencies(); }
+
+uint64_t loop::latency_histogram::percentile(double p) const
+{
+	if(count == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(count * p / 100.0);
+	if(rank >= count) {
+		rank = count - 1;
+	}
+	uint64_t seen = 0;
+	for(size_t i=0; i < buckets.size(); ++i) {
+		seen += buckets[i];
+		if(seen > rank) {
+			uint64_t upper = latency_histogram_impl::upper_of(i);
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
+
 shared_handler loop::add_handler_impl(shared_handler newh)
-	{ return ANON_impl->add_handler_impl(newh); }
+{
+	arm_timeout(newh);  // before an event can come
+	return ANON_impl->add_handler_impl(newh);
+}
 
 void loop::remove_handler(int fd)
 	{ ANON_impl->remove_handler(fd); }
 
-void loop::submit_impl(task_t f)
+void loop::submit_impl(task_t& f)
 	{ ANON_impl->submit_impl(f); }
 
+void loop::submit_impl(priority prio, task_t& f)
+	{ ANON_impl->submit_impl(prio, f); }
+
+void loop::submit_bulk_impl(task_t* tasks, size_t num)
+	{ ANON_impl->submit_bulk(tasks, num); }
+
 void loop::flush()
 	{ ANON_impl->flush(); }
 
@@ -21,7 +21,16 @@
 #include "mp/wavy.h"
 #include "mp/pthread.h"
 #include "wavy_kernel.h"
+#include "wavy_task_queue.h"
+#include "wavy_handler_table.h"
+#include "wavy_latency.h"
 #include <queue>
+#include <deque>
+#include <vector>
+
+#ifndef MP_WAVY_WORKER_MAX
+#define MP_WAVY_WORKER_MAX 1024
+#endif
 
 namespace mp {
 namespace wavy {
@@ -29,20 +38,377 @@ namespace {
 
 
 class out;
+class timer_wheel;
+class loop_impl;
+class worker;
+
+
+// counters of loop::stats(). a worker updates its own counters
+// without atomic operations; other threads share the counters of
+// the loop and update them atomically.
+class stat_counters {
+public:
+	enum {
+		EVENTS,
+		MORE,
+		TASKS,
+		TASK_QUEUE_MAX,
+		POLLS,
+		POLLED,
+		POLL_BATCH_MAX,
+		CLAIMS,
+		BYTES_WRITTEN,
+		WRITE_AGAIN,
+		BUDGET_REQUEUE,
+		NUM
+	};
+
+	stat_counters(bool shared) : m_shared(shared)
+	{
+		for(int i=0; i < NUM; ++i) {
+			m_count[i] = 0;
+		}
+	}
+
+	void add(int index, uint64_t n)
+	{
+		if(m_shared) {
+			__sync_add_and_fetch(&m_count[index], n);
+		} else {
+			m_count[index] += n;
+		}
+	}
+
+	void max(int index, uint64_t n)
+	{
+		uint64_t cur = m_count[index];
+		while(n > cur) {
+			if(!m_shared) {
+				m_count[index] = n;
+				return;
+			}
+			if(__sync_bool_compare_and_swap(&m_count[index], cur, n)) {
+				return;
+			}
+			cur = m_count[index];
+		}
+	}
+
+	uint64_t get(int index) const
+	{
+		return m_count[index];
+	}
+
+private:
+	volatile uint64_t m_count[NUM];
+	bool m_shared;
+};
+
+
+class shard {
+public:
+	shard(loop_impl* lo, void* fdctx);
+	~shard();
+
+	typedef shared_ptr<basic_handler> shared_handler;
+	typedef mp::task task_t;
+
+public:
+	void run_once();
+	void run_nonblock();
+
+	void run_once(pthread_scoped_lock& lk, bool block = true);
+
+	void submit_impl(task_t& f);
+	void submit_impl(loop::priority prio, task_t& f);
+	void submit_bulk(task_t* tasks, size_t num);
+
+	void wakeup();
+	inline void wakeup_one();
+	void wakeup_some(size_t num);
+	void notify_flush();
+
+	kernel& get_kernel()
+	{
+		return m_kernel;
+	}
+
+	const shared_ptr<out>& get_out() const
+	{
+		return m_out;
+	}
+
+	loop_impl* get_loop() const
+	{
+		return m_loop;
+	}
+
+	void flush();
+
+	// number of tasks and events waiting for a thread
+	size_t queued();
+
+	int sleeping() const
+	{
+		return m_sleeping;
+	}
+
+public:
+	void thread_main(worker* self);
+	inline void park(pthread_scoped_lock& lk);
+	inline void notify();
+	inline void poke();
+	inline int wait_kernel(int timeout, unsigned int seq);
+	typedef task_queue<task_t> task_queue_t;
+	inline void do_task(pthread_scoped_lock& lk, task_queue_t& queue);
+	inline bool has_task() const;
+	inline void do_out(pthread_scoped_lock& lk);
+	inline bool retire(worker* self);
+	inline void dispatch(kernel::event ke, pthread_scoped_lock& lk,
+			uint64_t polled_at = 0);
+	inline bool call_handler(kernel::event ke, uint64_t polled_at);
+	inline void event_more(kernel::event ke);
+	inline void event_yield(kernel::event ke);
+	inline void requeue_yielded();
+	inline void event_next(kernel::event ke);
+	inline void event_remove(kernel::event ke);
+
+private:
+	volatile size_t m_off;
+	volatile size_t m_num;
+	volatile bool m_pollable;
+	volatile int m_poll_blocked;  // 1 while a thread blocks in m_kernel.wait
+	uint64_t m_polled_at;  // MP_WAVY_LATENCY_NOW() of the backlog
+
+	kernel::backlog m_backlog;
+
+	kernel m_kernel;
+	kernel::wakeup m_wakeup;  // makes the blocked poller return
+
+	pthread_mutex m_mutex;
+	pthread_cond m_cond;
+	volatile int m_sleeping;  // number of threads waiting on m_cond
+	volatile unsigned int m_wake_seq;  // bumped whenever work is signaled
+
+	task_queue_t m_task_queue;
+	task_queue_t m_high_queue;
+	task_queue_t m_low_queue;
+	unsigned int m_low_turn;
+	volatile int m_running;  // tasks taken from the queues and not finished
+
+	typedef std::queue<kernel::event> more_queue_t;
+	more_queue_t m_more_queue;
+	more_queue_t m_yield_queue;  // used up the read budget
+
+	pthread_cond m_flush_cond;
+	volatile int m_flushing;  // number of threads waiting on m_flush_cond
+
+private:
+	shared_ptr<out> m_out;
+
+	loop_impl* m_loop;
+
+private:
+	shard(const shard&);
+};
+
+
+// Local task deque of a worker thread. Tasks submitted from a worker
+// are queued here and run by the same worker; idle workers steal them.
+class worker {
+public:
+	worker(shard* s, handler_table::slot* es, size_t index, int cpu) :
+		m_shard(s), m_size(0), m_running(0), m_epoch_slot(es),
+		m_index(index), m_cpu(cpu),
+		m_joinable(false), m_state(STATE_RUNNING),
+		m_stats(false)
+#ifdef ENABLE_HANDLER_LATENCY
+		, m_latency(false)
+#endif
+		{ }
+	~worker() { }
+
+	typedef mp::task task_t;
+
+	shard* get_shard() const
+	{
+		return m_shard;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	// true while a task popped from this worker is running
+	bool running() const
+	{
+		return m_running != 0;
+	}
+
+	void push(task_t& f)
+	{
+		pthread_scoped_lock lk(m_mutex);
+		m_deque.push_back(task_t());
+		m_deque.back().swap(f);
+		__sync_add_and_fetch(&m_size, 1);
+	}
+
+	void push_bulk(task_t* tasks, size_t num)
+	{
+		pthread_scoped_lock lk(m_mutex);
+		for(size_t i=0; i < num; ++i) {
+			m_deque.push_back(task_t());
+			m_deque.back().swap(tasks[i]);
+		}
+		__sync_add_and_fetch(&m_size, num);
+	}
+
+	bool pop(task_t* f)
+	{
+		if(empty()) {
+			return false;
+		}
+		pthread_scoped_lock lk(m_mutex);
+		if(m_deque.empty()) {
+			return false;
+		}
+		f->swap(m_deque.front());
+		m_deque.pop_front();
+		__sync_add_and_fetch(&m_running, 1);  // before m_size drops
+		__sync_sub_and_fetch(&m_size, 1);
+		return true;
+	}
+
+	// called after a task popped from this worker finished
+	void done()
+	{
+		if(__sync_sub_and_fetch(&m_running, 1) == 0 && empty()) {
+			m_shard->notify_flush();
+		}
+	}
+
+	// buffer for the events claimed from the backlog at once
+	kernel::event* slice()
+	{
+		return m_slice;
+	}
+
+	handler_table::slot* epoch_slot()
+	{
+		return m_epoch_slot;
+	}
+
+	// updated by the worker thread only
+	stat_counters& stats()
+	{
+		return m_stats;
+	}
+
+#ifdef ENABLE_HANDLER_LATENCY
+	latency_table& latency()
+	{
+		return m_latency;
+	}
+#endif
+
+	size_t index() const
+	{
+		return m_index;
+	}
+
+	int cpu() const
+	{
+		return m_cpu;
+	}
+
+	void set_cpu(int cpu)
+	{
+		m_cpu = cpu;
+	}
+
+	enum {
+		STATE_RUNNING  = 0,
+		STATE_RETIRING = 1,  // asked to exit by remove_thread
+		STATE_EXITED   = 2
+	};
+
+	int state() const
+	{
+		return m_state;
+	}
+
+	bool set_state(int from, int to)
+	{
+		return __sync_bool_compare_and_swap(&m_state, from, to);
+	}
+
+	// the thread and m_joinable are guarded by the pool mutex of the loop
+	pthread_thread& thread()
+	{
+		return m_thread;
+	}
+
+	bool is_joinable() const
+	{
+		return m_joinable;
+	}
+
+	void set_joinable(bool on)
+	{
+		m_joinable = on;
+	}
+
+private:
+	shard* m_shard;
+	pthread_mutex m_mutex;
+	std::deque<task_t> m_deque;
+	volatile size_t m_size;
+	volatile int m_running;
+
+	handler_table::slot* m_epoch_slot;
+
+	size_t m_index;
+	volatile int m_cpu;
+
+	pthread_thread m_thread;
+	bool m_joinable;
+	volatile int m_state;
+
+	char m_pad[MP_WAVY_CACHELINE_SIZE];
+	stat_counters m_stats;
+#ifdef ENABLE_HANDLER_LATENCY
+	latency_table m_latency;
+#endif
+
+	kernel::event m_slice[MP_WAVY_KERNEL_BACKLOG_SIZE];
+
+private:
+	worker(const worker&);
+};
 
 
 class loop_impl {
 public:
 	loop_impl(function<void ()> thread_init_func = function<void ()>());
+	loop_impl(size_t shards, function<void ()> thread_init_func = function<void ()>());
 	~loop_impl();
 
 	typedef shared_ptr<basic_handler> shared_handler;
-	typedef function<void ()> task_t;
+	typedef mp::task task_t;
 
 public:
 	void start(size_t num);
 	void start(size_t num, size_t max);
 
+	void set_placement(const loop::placement& pl);
+	std::vector<int> worker_cpus() const;
+
 	bool is_running() const;
 
 	void end();
@@ -51,78 +417,236 @@ public:
 	void run_once();
 	void run_nonblock();
 
-	void run_once(pthread_scoped_lock& lk, bool block = true);
-
 	void join();
 	void detach();
 
 	void add_thread(size_t num);
+	void remove_thread(size_t num);
+	size_t num_threads() const;
+
+	void set_autoscale(size_t min_threads, size_t max_threads,
+			double interval_sec);
+
+	void set_dispatch_batch(size_t num);
+
+	size_t get_dispatch_batch() const
+	{
+		return m_dispatch_batch;
+	}
+
+	void set_more_budget(size_t num)
+	{
+		m_more_budget = num;
+	}
+
+	size_t get_more_budget() const
+	{
+		return m_more_budget;
+	}
+
+	void set_read_budget(size_t amount)
+	{
+		m_read_budget = amount;
+	}
+
+	size_t get_read_budget() const
+	{
+		return m_read_budget;
+	}
+
+	loop::statistics stats() const;
+
+	// counters of the calling thread
+	inline stat_counters& local_stats();
+
+	std::vector<loop::handler_latency> handler_latencies() const;
+#ifdef ENABLE_HANDLER_LATENCY
+	inline latency_table& local_latency();
+#endif
+
+	void set_idle_policy(size_t spin, size_t yield)
+	{
+		m_idle_spin = spin;
+		m_idle_yield = yield;
+	}
+
+	size_t get_idle_spin() const
+	{
+		return m_idle_spin;
+	}
+
+	size_t get_idle_yield() const
+	{
+		return m_idle_yield;
+	}
 
 	shared_handler add_handler_impl(shared_handler sh);
 
 	void remove_handler(int fd);
 
 	void submit_impl(task_t& f);
+	void submit_impl(loop::priority prio, task_t& f);
+	void submit_bulk(task_t* tasks, size_t num);
 
 	void set_handler(shared_handler sh)
 	{
-		m_state[sh->ident()] = sh;
+		m_handlers->set(sh);
+		m_service[sh->ident()] = SERVICE_IDLE;
+		m_handlers->reclaim();
 	}
 
 	void reset_handler(int ident)
 	{
-		m_state[ident].reset();
+		m_handlers->reset(ident);
+		m_service[ident] = SERVICE_IDLE;
+		m_handlers->reclaim();
+	}
+
+	// resets only if the fd still has the handler of the entry
+	void reset_handler(int ident, handler_table::entry* expect)
+	{
+		if(m_handlers->reset(ident, expect)) {
+			m_service[ident] = SERVICE_IDLE;
+		}
+		m_handlers->reclaim();
+	}
+
+	handler_table& get_handlers()
+	{
+		return *m_handlers;
+	}
+
+	// edge-triggered fds stay armed while a handler runs. these keep
+	// one thread per fd: an event that arrives while the fd is in service
+	// is recorded, and the thread in service runs the handler once more.
+	bool enter_service(int ident)
+	{
+		while(true) {
+			int s = m_service[ident];
+			if(s == SERVICE_IDLE) {
+				if(__sync_bool_compare_and_swap(&m_service[ident],
+							SERVICE_IDLE, SERVICE_BUSY)) {
+					return true;
+				}
+			} else if(s == SERVICE_BUSY) {
+				if(__sync_bool_compare_and_swap(&m_service[ident],
+							SERVICE_BUSY, SERVICE_PENDING)) {
+					return false;
+				}
+			} else {
+				return false;
+			}
+		}
 	}
 
+	// returns false if an event arrived while in service
+	bool leave_service(int ident)
+	{
+		while(true) {
+			int s = m_service[ident];
+			if(s == SERVICE_PENDING) {
+				if(__sync_bool_compare_and_swap(&m_service[ident],
+							SERVICE_PENDING, SERVICE_BUSY)) {
+					return false;
+				}
+			} else if(s == SERVICE_BUSY) {
+				if(__sync_bool_compare_and_swap(&m_service[ident],
+							SERVICE_BUSY, SERVICE_IDLE)) {
+					return true;
+				}
+			} else {
+				return true;  // handler was reset
+			}
+		}
+	}
+
+	// timers and signals are owned by the first shard
 	kernel& get_kernel()
 	{
-		return m_kernel;
+		return m_shards[0]->get_kernel();
+	}
+
+	shard& shard_of(int fd)
+	{
+		return *m_shards[fd % m_shards.size()];
+	}
+
+	// timers of add_timer
+	timer_wheel& get_timer_wheel()
+	{
+		return *m_timer_wheel;
 	}
 
 	void flush();
 
+	worker* steal_task(worker* self, task_t* f);
+
+	bool has_local_task(shard* s) const;
+
 public:
-	void thread_main();
-	inline void do_task(pthread_scoped_lock& lk);
-	inline void do_out(pthread_scoped_lock& lk);
-	inline void event_more(kernel::event ke);
-	inline void event_next(kernel::event ke);
-	inline void event_remove(kernel::event ke);
+	void thread_main(worker* self);
+	void scaler_main();
 
 private:
-	volatile size_t m_off;
-	volatile size_t m_num;
-	volatile bool m_pollable;
-//	volatile pthread_t m_poll_thread;  // FIXME signal_stop
+	void init(size_t shards);
 
-	kernel::backlog m_backlog;
+	int cpu_of(size_t index) const;
+	void start_worker(worker* w);
+	void autoscale_tick();
 
-	shared_handler* m_state;
+	handler_table* m_handlers;
 
-	kernel m_kernel;
+	enum {
+		SERVICE_IDLE    = 0,
+		SERVICE_BUSY    = 1,
+		SERVICE_PENDING = 2
+	};
+	volatile int* m_service;
 
-	pthread_mutex m_mutex;
-	pthread_cond m_cond;
+	void* m_fdctx;
 
-	typedef std::queue<task_t> task_queue_t;
-	task_queue_t m_task_queue;
+	typedef std::vector< shared_ptr<shard> > shards_t;
+	shards_t m_shards;
+	volatile unsigned int m_rr;
 
-	typedef std::queue<kernel::event> more_queue_t;
-	more_queue_t m_more_queue;
+	timer_wheel* m_timer_wheel;  // owned by m_handlers
 
-	function<void ()> m_thread_init_func;
+	volatile size_t m_dispatch_batch;
+	volatile size_t m_more_budget;
+	volatile size_t m_read_budget;
 
-	pthread_cond m_flush_cond;
+	volatile size_t m_idle_spin;
+	volatile size_t m_idle_yield;
 
-private:
-	shared_ptr<out> m_out;
-	friend class wavy::loop;
+	function<void ()> m_thread_init_func;
+
+	loop::placement m_placement;
 
 private:
 	volatile bool m_end_flag;
 
-	typedef std::vector<pthread_thread> workers_t;
-	workers_t m_workers;
+	// worker contexts are never removed while the loop is alive,
+	// so that thieves can scan them without locking. a context whose
+	// thread exited is reused by add_thread.
+	worker* m_contexts[MP_WAVY_WORKER_MAX];
+	volatile size_t m_ncontexts;
+
+	pthread_mutex m_pool_mutex;
+	pthread_cond m_pool_cond;
+	volatile size_t m_nthreads;  // threads started and not joined
+
+	size_t m_scale_min;
+	size_t m_scale_max;
+	double m_scale_interval;
+	unsigned int m_scale_busy;  // consecutive samples with a deep queue
+	unsigned int m_scale_idle;  // consecutive samples with a parked thread
+	pthread_thread m_scaler;
+	bool m_scaler_running;
+
+	stat_counters m_shared_stats;
+#ifdef ENABLE_HANDLER_LATENCY
+	latency_table m_shared_latency;
+#endif
 
 private:
 	loop_impl(const loop_impl&);
@@ -133,9 +657,12 @@ private:
 
 class event_impl : public event {
 public:
-	event_impl(loop_impl* lo, kernel::event ke) :
+	event_impl(shard* sh, kernel::event ke,
+			size_t more_budget = 0, size_t read_budget = 0) :
 		m_flags(0),
-		m_loop(lo),
+		m_more_left(more_budget),
+		m_budget(read_budget != 0 ? read_budget : (size_t)NO_BUDGET),
+		m_shard(sh),
 		m_pe(ke) { }
 
 	~event_impl() { }
@@ -150,18 +677,39 @@ public:
 		return (m_flags & FLAG_REMOVED) != 0;
 	}
 
+	// event::more() asked to run the handler again on this thread
+	bool is_continued()
+	{
+		return (m_flags & (FLAG_CONTINUED|FLAG_REMOVED)) == FLAG_CONTINUED;
+	}
+
+	void next_turn()
+	{
+		m_flags = 0;
+	}
+
+	static const size_t NO_BUDGET = (size_t)-1;
+
 	const kernel::event& get_kernel_event() const
 	{
 		return m_pe;
 	}
 
+	shard* get_shard() const
+	{
+		return m_shard;
+	}
+
 private:
 	enum {
 		FLAG_REACTIVATED = 0x01,
 		FLAG_REMOVED     = 0x02,
+		FLAG_CONTINUED   = 0x04,
 	};
 	int m_flags;
-	loop_impl* m_loop;
+	size_t m_more_left;
+	size_t m_budget;
+	shard* m_shard;
 	kernel::event m_pe;
 	friend class event;
 };
@@ -29,6 +29,11 @@
 #include <sys/sendfile.h>
 #endif
 
+// max number of iovecs written by a request to the kernel
+#ifndef MP_WAVY_OUT_GATHER
+#define MP_WAVY_OUT_GATHER 64
+#endif
+
 namespace mp {
 namespace wavy {
 namespace {
@@ -36,10 +41,15 @@ namespace {
 
 class xfer_impl : public xfer {
 public:
+#ifdef MP_WAVY_KERNEL_IO_URING
+	xfer_impl() : m_vec(NULL) { }
+	~xfer_impl() { ::free(m_vec); }
+#else
 	xfer_impl() { }
 	~xfer_impl() { }
+#endif
 
-	bool try_write(int fd);
+	bool try_write(int fd, stat_counters& st);
 
 	void push_xfraw(char* buf, size_t size);
 
@@ -53,13 +63,22 @@ public:
 	static char* fill_sendfile(char* from, int infd, uint64_t off, size_t len);
 	static char* fill_finalize(char* from, finalize_t fin, void* user);
 
-	static bool execute(int fd, char* head, char** tail);
+	static bool execute(int fd, char* head, char** tail, stat_counters& st);
+
+#ifdef MP_WAVY_KERNEL_IO_URING
+	bool submit(int fd, kernel& kern);
+	bool complete(int fd, kernel::event e, stat_counters& st);
+	void consume(size_t wl);
+#endif
 
 public:
 	pthread_mutex& mutex() { return m_mutex; }
 
 private:
 	pthread_mutex m_mutex;
+#ifdef MP_WAVY_KERNEL_IO_URING
+	struct iovec* m_vec;  // read by the kernel until the completion
+#endif
 
 private:
 	xfer_impl(const xfer_impl&);
@@ -169,7 +188,16 @@ void xfer_impl::push_xfraw(char* buf, size_t size)
 		*tail = head + left; \
 	} while(0)
 
-bool xfer_impl::execute(int fd, char* head, char** tail)
+static inline void count_written(stat_counters& st, ssize_t wl)
+{
+	if(wl > 0) {
+		st.add(stat_counters::BYTES_WRITTEN, wl);
+	} else if(wl < 0 && errno == EAGAIN) {
+		st.add(stat_counters::WRITE_AGAIN, 1);
+	}
+}
+
+bool xfer_impl::execute(int fd, char* head, char** tail, stat_counters& st)
 {
 	char* p = head;
 	char* const endp = *tail;
@@ -180,6 +208,7 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 #if defined(__linux__) || defined(__sun__)
 			off_t off = x->off;
 			ssize_t wl = ::sendfile(fd, x->infd, &off, x->len);
+			count_written(st, wl);
 			if(wl <= 0) {
 				MP_WAVY_XFER_CONSUMED;
 				if(wl < 0 && (errno == EAGAIN || errno == EINTR)) {
@@ -191,6 +220,7 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 #elif defined(__APPLE__) && defined(__MACH__)
 			off_t wl = x->len;
 			if(::sendfile(x->infd, fd, x->off, &wl, NULL, 0) < 0) {
+				count_written(st, -1);
 				MP_WAVY_XFER_CONSUMED;
 				if(errno == EAGAIN || errno == EINTR) {
 					return true;
@@ -201,6 +231,7 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 #else
 			off_t sbytes = 0;
 			if(::sendfile(x->infd, fd, x->off, x->len, NULL, &sbytes, 0) < 0) {
+				count_written(st, -1);
 				MP_WAVY_XFER_CONSUMED;
 				if(errno == EAGAIN || errno == EINTR) {
 					return true;
@@ -210,6 +241,9 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 			}
 			off_t wl = x->len + sbytes;
 #endif
+#if !defined(__linux__) && !defined(__sun__)
+			count_written(st, wl);
+#endif
 
 			if(static_cast<size_t>(wl) < x->len) {
 				x->off += wl;
@@ -235,6 +269,7 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 			struct iovec* vec = (struct iovec*)(p + sizeof(xfer_type));
 
 			ssize_t wl = ::writev(fd, vec, veclen);
+			count_written(st, wl);
 			if(wl <= 0) {
 				MP_WAVY_XFER_CONSUMED;
 				if(wl < 0 && (errno == EAGAIN || errno == EINTR)) {
@@ -276,10 +311,10 @@ bool xfer_impl::execute(int fd, char* head, char** tail)
 }
 
 
-bool xfer_impl::try_write(int fd)
+bool xfer_impl::try_write(int fd, stat_counters& st)
 {
 	char* const alloc_end = m_tail + m_free;
-	bool cont = execute(fd, m_head, &m_tail);
+	bool cont = execute(fd, m_head, &m_tail, st);
 	m_free = alloc_end - m_tail;
 
 	if(!cont && !empty()) {
@@ -290,6 +325,133 @@ bool xfer_impl::try_write(int fd)
 }
 
 
+#ifdef MP_WAVY_KERNEL_IO_URING
+// Writes of the kernel complete asynchronously. The head of the
+// context is written by one request at a time; the entries stay
+// in the context until the completion consumes them.
+
+// Submits a writev of the iovecs at the head, gathered over the
+// entries up to a sendfile. Returns false if nothing is left.
+bool xfer_impl::submit(int fd, kernel& kern)
+{
+	consume(0);  // runs the finalizers at the head
+	if(empty()) {
+		return false;
+	}
+
+	if(*(xfer_type*)m_head == XF_SENDFILE) {
+		// sendfile runs synchronously when the fd becomes writable
+		if(kern.submit_poll_write(fd) < 0) {
+			throw system_error(errno, "failed to submit a write");
+		}
+		return true;
+	}
+
+	if(!m_vec) {
+		m_vec = (struct iovec*)::malloc(
+				sizeof(struct iovec) * MP_WAVY_OUT_GATHER);
+		if(!m_vec) {
+			throw std::bad_alloc();
+		}
+	}
+
+	struct iovec* const vec = m_vec;
+	size_t n = 0;
+	for(char* p = m_head; p < m_tail && n < MP_WAVY_OUT_GATHER; ) {
+		xfer_type t = *(xfer_type*)p;
+		if(t == XF_SENDFILE) {
+			break;
+		} else if(t == XF_FINALIZE) {
+			p += sizeof_finalize();
+			continue;
+		}
+		size_t veclen = t >> 1;
+		struct iovec* v = (struct iovec*)(p + sizeof(xfer_type));
+		for(size_t i=0; i < veclen && n < MP_WAVY_OUT_GATHER; ++i) {
+			if(v[i].iov_len > 0) {
+				vec[n++] = v[i];
+			}
+		}
+		p += sizeof_iovec(veclen);
+	}
+
+	if(kern.submit_writev(fd, vec, n) < 0) {
+		throw system_error(errno, "failed to submit a write");
+	}
+	return true;
+}
+
+// Consumes the completion of submit(). Returns false if an error
+// occured.
+bool xfer_impl::complete(int fd, kernel::event e, stat_counters& st)
+{
+	if(!e.is_write()) {
+		return try_write(fd, st);
+	}
+
+	int res = e.result();
+	if(res <= 0) {
+		if(res < 0) {
+			errno = -res;
+			count_written(st, -1);
+			if(errno == EAGAIN || errno == EINTR) {
+				return true;
+			}
+		}
+		::shutdown(fd, SHUT_RD);
+		return false;
+	}
+
+	count_written(st, res);
+	consume(res);
+	return true;
+}
+
+// Removes wl bytes from the head, and runs the finalizers of which
+// all data before are written.
+void xfer_impl::consume(size_t wl)
+{
+	char* p = m_head;
+	char* const endp = m_tail;
+	while(p < endp) {
+		xfer_type t = *(xfer_type*)p;
+		if(t == XF_SENDFILE) {
+			break;
+		} else if(t == XF_FINALIZE) {
+			xfer_finalize* x = (xfer_finalize*)(p + sizeof(xfer_type));
+			if(x->finalize) try {
+				x->finalize(x->user);
+			} catch (...) { }
+			p += sizeof_finalize();
+			continue;
+		}
+
+		size_t veclen = t >> 1;
+		struct iovec* vec = (struct iovec*)(p + sizeof(xfer_type));
+		size_t i = 0;
+		for(; i < veclen; ++i) {
+			if(wl < vec[i].iov_len) {
+				break;
+			}
+			wl -= vec[i].iov_len;
+			vec[i].iov_len = 0;  // written
+		}
+		if(i < veclen) {
+			vec[i].iov_base = (void*)(((char*)vec[i].iov_base) + wl);
+			vec[i].iov_len -= wl;
+			break;
+		}
+		p += sizeof_iovec(veclen);
+	}
+
+	size_t left = endp - p;
+	::memmove(m_head, p, left);
+	m_tail = m_head + left;
+	m_free += p - m_head;
+}
+#endif
+
+
 }  // noname namespace
 
 
@@ -398,18 +560,24 @@ void xfer::clear()
 
 #define ANON_fdctx reinterpret_cast<xfer_impl*>(m_fdctx)
 
-out::out() : basic_handler(m_kernel.ident(), this), m_watching(0)
+out::out(loop_impl* lo, void* fdctx) :
+	basic_handler(m_kernel.ident(), this), m_watching(0), m_fdctx(fdctx),
+	m_loop(lo) { }
+
+out::~out() { }
+
+void* out::alloc_fdctx()
 {
 	struct rlimit rbuf;
 	if(::getrlimit(RLIMIT_NOFILE, &rbuf) < 0) {
 		throw system_error(errno, "getrlimit() failed");
 	}
-	m_fdctx = new xfer_impl[rbuf.rlim_cur];
+	return new xfer_impl[rbuf.rlim_cur];
 }
 
-out::~out()
+void out::free_fdctx(void* fdctx)
 {
-	delete[] ANON_fdctx;
+	delete[] reinterpret_cast<xfer_impl*>(fdctx);
 }
 
 void out::poll_event()
@@ -435,9 +603,24 @@ bool out::write_event(kernel::event e)
 	xfer_impl& ctx(ANON_fdctx[ident]);
 	pthread_scoped_lock lk(ctx.mutex());
 
+#ifdef MP_WAVY_KERNEL_IO_URING
+	bool cont;
+	try {
+		cont = ctx.complete(ident, e, m_loop->local_stats()) &&
+			ctx.submit(ident, m_kernel);
+	} catch (...) {
+		cont = false;
+	}
+
+	if(!cont) {
+		ctx.clear();
+		return __sync_sub_and_fetch(&m_watching, 1) == 0;
+	}
+	return false;
+#else
 	bool cont;
 	try {
-		cont = ctx.try_write(ident);
+		cont = ctx.try_write(ident, m_loop->local_stats());
 	} catch (...) {
 		cont = false;
 	}
@@ -450,11 +633,19 @@ bool out::write_event(kernel::event e)
 		m_kernel.reactivate(e);
 		return false;
 	}
+#endif
 }
 
+// called with the context of the fd locked
 inline void out::watch(int fd)
 {
+#ifdef MP_WAVY_KERNEL_IO_URING
+	if(!ANON_fdctx[fd].submit(fd, m_kernel)) {
+		return;
+	}
+#else
 	m_kernel.add_fd(fd, EVKERNEL_WRITE);
+#endif
 	__sync_add_and_fetch(&m_watching, 1);
 }
 
@@ -469,7 +660,7 @@ void out::commit_raw(int fd, char* xfbuf, char* xfendp)
 		return;
 	}
 
-	if(xfer_impl::execute(fd, xfbuf, &xfendp)) {
+	if(xfer_impl::execute(fd, xfbuf, &xfendp, m_loop->local_stats())) {
 		ctx.push_xfraw(xfbuf, xfendp - xfbuf);  // FIXME exception
 		watch(fd);  // FIXME exception
 	}
@@ -485,7 +676,7 @@ void out::commit(int fd, xfer* xf)
 		return;
 	}
 
-	if(static_cast<xfer_impl*>(xf)->try_write(fd)) {
+	if(static_cast<xfer_impl*>(xf)->try_write(fd, m_loop->local_stats())) {
 		xf->migrate(&ctx);  // FIXME exception
 		watch(fd);  // FIXME exception
 	}
@@ -498,6 +689,7 @@ void out::write(int fd, const void* buf, size_t size)
 
 	if(ctx.empty()) {
 		ssize_t wl = ::write(fd, buf, size);
+		count_written(m_loop->local_stats(), wl);
 		if(wl <= 0) {
 			if(wl == 0 || (errno != EINTR && errno != EAGAIN)) {
 				::shutdown(fd, SHUT_RD);
@@ -519,13 +711,13 @@ void out::write(int fd, const void* buf, size_t size)
 }
 
 
-#define ANON_out static_cast<loop_impl*>(m_impl)->m_out
+#define ANON_out(fd) static_cast<loop_impl*>(m_impl)->shard_of(fd).get_out()
 
 void loop::commit(int fd, xfer* xf)
-	{ ANON_out->commit(fd, xf); }
+	{ ANON_out(fd)->commit(fd, xf); }
 
 void loop::write(int fd, const void* buf, size_t size)
-	{ ANON_out->write(fd, buf, size); }
+	{ ANON_out(fd)->write(fd, buf, size); }
 
 void loop::write(int fd,
 		const void* buf, size_t size,
@@ -535,7 +727,7 @@ void loop::write(int fd,
 	char* p = xfbuf;
 	p = xfer_impl::fill_mem(p, buf, size);
 	p = xfer_impl::fill_finalize(p, fin, user);
-	ANON_out->commit_raw(fd, xfbuf, p);
+	ANON_out(fd)->commit_raw(fd, xfbuf, p);
 }
 
 void loop::writev(int fd,
@@ -546,7 +738,7 @@ void loop::writev(int fd,
 	char* p = xfbuf;
 	p = xfer_impl::fill_iovec(p, vec, veclen);
 	p = xfer_impl::fill_finalize(p, fin, user);
-	ANON_out->commit_raw(fd, xfbuf, p);
+	ANON_out(fd)->commit_raw(fd, xfbuf, p);
 }
 
 void loop::sendfile(int fd,
@@ -557,7 +749,7 @@ void loop::sendfile(int fd,
 	char* p = xfbuf;
 	p = xfer_impl::fill_sendfile(p, infd, off, size);
 	p = xfer_impl::fill_finalize(p, fin, user);
-	ANON_out->commit_raw(fd, xfbuf, p);
+	ANON_out(fd)->commit_raw(fd, xfbuf, p);
 }
 
 void loop::hsendfile(int fd,
@@ -571,7 +763,7 @@ void loop::hsendfile(int fd,
 	p = xfer_impl::fill_mem(p, header, header_size);
 	p = xfer_impl::fill_sendfile(p, infd, off, size);
 	p = xfer_impl::fill_finalize(p, fin, user);
-	ANON_out->commit_raw(fd, xfbuf, p);
+	ANON_out(fd)->commit_raw(fd, xfbuf, p);
 }
 
 void loop::hvsendfile(int fd,
@@ -585,7 +777,7 @@ void loop::hvsendfile(int fd,
 	p = xfer_impl::fill_iovec(p, header_vec, header_veclen);
 	p = xfer_impl::fill_sendfile(p, infd, off, size);
 	p = xfer_impl::fill_finalize(p, fin, user);
-	ANON_out->commit_raw(fd, xfbuf, p);
+	ANON_out(fd)->commit_raw(fd, xfbuf, p);
 }
 
 
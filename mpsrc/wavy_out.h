@@ -32,9 +32,13 @@ struct kernel_mixin {
 
 class out : protected kernel_mixin, public basic_handler {
 public:
-	out();
+	out(loop_impl* lo, void* fdctx);
 	~out();
 
+	// per-fd write contexts are shared by the outs of all shards
+	static void* alloc_fdctx();
+	static void free_fdctx(void* fdctx);
+
 	typedef loop::finalize_t finalize_t;
 
 	inline void commit_raw(int fd, char* xfbuf, char* xfendp);
@@ -75,6 +79,12 @@ public:
 		return m_watching == 0;
 	}
 
+	// number of fds waiting to write queued data
+	size_t watching() const
+	{
+		return m_watching;
+	}
+
 private:
 	std::queue<kernel::event> m_queue;
 	kernel::backlog m_backlog;
@@ -83,6 +93,8 @@ private:
 	void watch(int fd);
 	void* m_fdctx;
 
+	loop_impl* m_loop;
+
 private:
 	out(const out&);
 };
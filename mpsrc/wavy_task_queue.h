@@ -0,0 +1,181 @@
+//
+// mpio wavy task queue
+//
+// Copyright (C) 2008-2010 FURUHASHI Sadayuki
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//        http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+//
+#ifndef WAVY_TASK_QUEUE_H__
+#define WAVY_TASK_QUEUE_H__
+
+#include "mp/pthread.h"
+#include "wavy_atomic.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <queue>
+
+#ifndef MP_WAVY_TASK_RING_SIZE
+#define MP_WAVY_TASK_RING_SIZE 1024  // must be power of 2
+#endif
+
+namespace mp {
+namespace wavy {
+namespace {
+
+
+// Bounded lock-free multi-producer multi-consumer ring
+// (D. Vyukov's algorithm) with an unbounded overflow queue.
+// Once the ring is full, tasks go to the overflow queue until it drains
+// so that the order of tasks is kept.
+template <typename T>
+class task_queue {
+public:
+	task_queue() :
+		m_buffer(new cell[MP_WAVY_TASK_RING_SIZE]),
+		m_mask(MP_WAVY_TASK_RING_SIZE - 1),
+		m_enqueue_pos(0), m_dequeue_pos(0),
+		m_overflow_size(0)
+	{
+		for(size_t i=0; i < MP_WAVY_TASK_RING_SIZE; ++i) {
+			m_buffer[i].seq = i;
+		}
+	}
+
+	~task_queue()
+	{
+		delete[] m_buffer;
+	}
+
+	// takes the content of x with swap(); x is left empty
+	void push(T& x)
+	{
+		if(MP_WAVY_LOAD_ACQUIRE(&m_overflow_size) == 0 && try_push(x)) {
+			return;
+		}
+		pthread_scoped_lock lk(m_overflow_mutex);
+		m_overflow.push(T());
+		m_overflow.back().swap(x);
+		__sync_add_and_fetch(&m_overflow_size, 1);
+	}
+
+	bool pop(T* x)
+	{
+		if(try_pop(x)) {
+			return true;
+		}
+		if(MP_WAVY_LOAD_ACQUIRE(&m_overflow_size) == 0) {
+			return false;
+		}
+		pthread_scoped_lock lk(m_overflow_mutex);
+		if(m_overflow.empty()) {
+			return false;
+		}
+		x->swap(m_overflow.front());
+		m_overflow.pop();
+		__sync_sub_and_fetch(&m_overflow_size, 1);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	// approximate while other threads push or pop
+	size_t size() const
+	{
+		size_t deq = MP_WAVY_LOAD_ACQUIRE(&m_dequeue_pos);
+		size_t enq = MP_WAVY_LOAD_ACQUIRE(&m_enqueue_pos);
+		size_t ring = (enq > deq) ? enq - deq : 0;
+		return ring + MP_WAVY_LOAD_ACQUIRE(&m_overflow_size);
+	}
+
+private:
+	bool try_push(T& x)
+	{
+		cell* c;
+		size_t pos = MP_WAVY_LOAD_ACQUIRE(&m_enqueue_pos);
+		while(true) {
+			c = &m_buffer[pos & m_mask];
+			size_t seq = MP_WAVY_LOAD_ACQUIRE(&c->seq);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if(dif == 0) {
+				if(__sync_bool_compare_and_swap(&m_enqueue_pos, pos, pos+1)) {
+					break;
+				}
+				pos = MP_WAVY_LOAD_ACQUIRE(&m_enqueue_pos);
+			} else if(dif < 0) {
+				return false;  // full
+			} else {
+				pos = MP_WAVY_LOAD_ACQUIRE(&m_enqueue_pos);
+			}
+		}
+		c->data.swap(x);  // the cell is empty
+		MP_WAVY_STORE_RELEASE(&c->seq, pos+1);
+		return true;
+	}
+
+	bool try_pop(T* x)
+	{
+		cell* c;
+		size_t pos = MP_WAVY_LOAD_ACQUIRE(&m_dequeue_pos);
+		while(true) {
+			c = &m_buffer[pos & m_mask];
+			size_t seq = MP_WAVY_LOAD_ACQUIRE(&c->seq);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+			if(dif == 0) {
+				if(__sync_bool_compare_and_swap(&m_dequeue_pos, pos, pos+1)) {
+					break;
+				}
+				pos = MP_WAVY_LOAD_ACQUIRE(&m_dequeue_pos);
+			} else if(dif < 0) {
+				return false;  // empty
+			} else {
+				pos = MP_WAVY_LOAD_ACQUIRE(&m_dequeue_pos);
+			}
+		}
+		x->swap(c->data);  // *x is empty; the cell releases nothing
+		MP_WAVY_STORE_RELEASE(&c->seq, pos+m_mask+1);
+		return true;
+	}
+
+private:
+	struct cell {
+		size_t seq;
+		T data;
+	};
+
+	cell* const m_buffer;
+	const size_t m_mask;
+
+	char m_pad0[MP_WAVY_CACHELINE_SIZE];
+	size_t m_enqueue_pos;
+	char m_pad1[MP_WAVY_CACHELINE_SIZE];
+	size_t m_dequeue_pos;
+	char m_pad2[MP_WAVY_CACHELINE_SIZE];
+
+	size_t m_overflow_size;
+	pthread_mutex m_overflow_mutex;
+	std::queue<T> m_overflow;
+
+private:
+	task_queue(const task_queue&);
+};
+
+
+}  // noname namespace
+}  // namespace wavy
+}  // namespace mp
+
+#endif /* wavy_task_queue.h */
+
@@ -16,20 +16,25 @@
 //    limitations under the License.
 //
 #include "wavy_timer.h"
+#include "wavy_atomic.h"
 
 namespace mp {
 namespace wavy {
 
 
+static inline uint64_t spec2nsec(const timespec* spec)
+{
+	if(!spec) {
+		return 0;
+	}
+	return (uint64_t)spec->tv_sec * 1000000000ULL + spec->tv_nsec;
+}
+
 int loop::add_timer(const timespec* value, const timespec* interval,
 		function<bool ()> callback)
 {
-	kernel& kern(ANON_impl->get_kernel());
-
-	shared_handler sh(new timer_handler(kern, value, interval, callback));
-	ANON_impl->set_handler(sh);
-
-	return sh->ident();
+	return ANON_impl->get_timer_wheel().add(
+			spec2nsec(value), spec2nsec(interval), callback);
 }
 
 
@@ -64,8 +69,178 @@ int loop::add_timer(double value_sec, double interval_sec,
 }
 
 
+// Timeouts of a handler. The idle timer is not moved by each on_read:
+// on_read records the time, and the timer which expires checks it and
+// is added again for the rest of the time.
+// The setters, the worker and the timer callbacks run on different
+// threads: the fields are accessed atomically, and the setters bump the
+// generation first so that a pending check of the old setting gives up.
+struct handler::timeout_state {
+	timeout_state() :
+		idle(0), deadline(0), active(0),
+		idle_gen(0), deadline_gen(0), deadline_timer(0), changed(0) { }
+
+	enum {
+		IDLE_CHANGED     = 0x01,
+		DEADLINE_CHANGED = 0x02,
+	};
+
+	volatile uint64_t idle;      // nanoseconds, 0 if not set
+	volatile uint64_t deadline;  // latency_clock() of the deadline, 0 if not set
+	volatile uint64_t active;    // latency_clock() of the last on_read
+	volatile unsigned int idle_gen;  // timers of an older gen are stale
+	volatile unsigned int deadline_gen;
+	int deadline_timer;    // touched by arm() only
+	volatile int changed;  // armed by the loop
+
+	void set_idle(uint64_t nsec)
+	{
+		__sync_add_and_fetch(&idle_gen, 1);
+		MP_WAVY_STORE_RELEASE(&idle, nsec);
+		__sync_fetch_and_or(&changed, (int)IDLE_CHANGED);
+	}
+
+	void set_deadline(uint64_t at)
+	{
+		__sync_add_and_fetch(&deadline_gen, 1);
+		MP_WAVY_STORE_RELEASE(&deadline, at);
+		__sync_fetch_and_or(&changed, (int)DEADLINE_CHANGED);
+	}
+
+	struct idle_check {
+		idle_check(weak_ptr<handler> self, unsigned int gen, timer_wheel* wheel) :
+			self(self), gen(gen), wheel(wheel) { }
+
+		weak_ptr<handler> self;
+		unsigned int gen;
+		timer_wheel* wheel;
+
+		bool operator() ()
+		{
+			shared_ptr<handler> h(self.lock());
+			if(!h) {
+				return false;
+			}
+			timeout_state* t = h->m_timeout.get();
+			uint64_t at = MP_WAVY_LOAD_ACQUIRE(&t->active) +
+				MP_WAVY_LOAD_ACQUIRE(&t->idle);
+			if(MP_WAVY_LOAD_ACQUIRE(&t->idle_gen) != gen) {
+				return false;  // set again since; idle is of the new gen
+			}
+			uint64_t now = latency_clock();
+			if(at > now) {
+				wheel->add(at - now, 0, *this);  // dispatched since
+				return false;
+			}
+			h->on_timeout();
+			return false;
+		}
+	};
+
+	struct deadline_check {
+		deadline_check(weak_ptr<handler> self, unsigned int gen) :
+			self(self), gen(gen) { }
+
+		weak_ptr<handler> self;
+		unsigned int gen;
+
+		bool operator() ()
+		{
+			shared_ptr<handler> h(self.lock());
+			if(h && MP_WAVY_LOAD_ACQUIRE(&h->m_timeout->deadline_gen) == gen) {
+				h->on_timeout();
+			}
+			return false;
+		}
+	};
+
+	// a setter racing with arm() sets its flag again, and the timer
+	// added here for the older gen gives up
+	void arm(shared_ptr<handler> h, timer_wheel& wheel)
+	{
+		int flags = __sync_fetch_and_and(&changed, 0);
+		uint64_t now = latency_clock();
+
+		if(flags & IDLE_CHANGED) {
+			unsigned int gen = MP_WAVY_LOAD_ACQUIRE(&idle_gen);
+			uint64_t nsec = MP_WAVY_LOAD_ACQUIRE(&idle);
+			if(nsec != 0) {
+				MP_WAVY_STORE_RELEASE(&active, now);
+				wheel.add(nsec, 0, idle_check(h, gen, &wheel));
+			}
+		}
+
+		if(flags & DEADLINE_CHANGED) {
+			unsigned int gen = MP_WAVY_LOAD_ACQUIRE(&deadline_gen);
+			uint64_t at = MP_WAVY_LOAD_ACQUIRE(&deadline);
+			if(deadline_timer != 0) {
+				wheel.remove(deadline_timer);
+				deadline_timer = 0;
+			}
+			if(at != 0) {
+				deadline_timer = wheel.add(
+						(at > now) ? at - now : 1, 0,
+						deadline_check(h, gen));
+			}
+		}
+	}
+};
+
+static inline uint64_t sec2nsec(double sec)
+{
+	return (sec > 0.0) ? (uint64_t)(sec * 1e9) : 0;
+}
+
+void handler::set_idle_timeout(double sec)
+{
+	if(!m_timeout) {
+		m_timeout.reset(new timeout_state());
+	}
+	m_timeout->set_idle(sec2nsec(sec));
+}
+
+void handler::set_deadline(double sec)
+{
+	if(!m_timeout) {
+		m_timeout.reset(new timeout_state());
+	}
+	uint64_t nsec = sec2nsec(sec);
+	m_timeout->set_deadline((nsec != 0) ? latency_clock() + nsec : 0);
+}
+
+void handler::on_timeout()
+{
+	::shutdown(fd(), SHUT_RDWR);
+}
+
+void handler::refresh_timeout(event& e)
+{
+	timeout_state* t = m_timeout.get();
+	if(MP_WAVY_LOAD_ACQUIRE(&t->idle) != 0) {
+		MP_WAVY_STORE_RELEASE(&t->active, latency_clock());
+	}
+	if(t->changed) {
+		loop_impl* lo = static_cast<event_impl&>(e).get_shard()->get_loop();
+		t->arm(shared_self<handler>(), lo->get_timer_wheel());
+	}
+}
+
+void loop::arm_timeout(shared_handler sh)
+{
+	handler* h = dynamic_cast<handler*>(sh.get());
+	if(h && h->m_timeout && h->m_timeout->changed) {
+		h->m_timeout->arm(h->shared_self<handler>(),
+				ANON_impl->get_timer_wheel());
+	}
+}
+
+
 void loop::remove_timer(int ident)
 {
+	if(ident < 0) {
+		ANON_impl->get_timer_wheel().remove(ident);
+		return;
+	}
 	ANON_impl->reset_handler(ident);
 	kernel& kern(ANON_impl->get_kernel());
 	kern.remove_timer(ident);  // FIXME?
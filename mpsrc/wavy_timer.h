@@ -20,6 +20,13 @@
 
 #include "wavy_loop.h"
 #include <time.h>
+#include <stdexcept>
+#include <vector>
+
+// resolution of the timer wheel in nanoseconds
+#ifndef MP_WAVY_TIMER_TICK
+#define MP_WAVY_TIMER_TICK 1000000
+#endif
 
 namespace mp {
 namespace wavy {
@@ -47,6 +54,11 @@ protected:
 		return kernel::read_timer( static_cast<event_impl&>(e).get_kernel_event() );
 	}
 
+	int reset_timer(kernel& kern, const timespec* value)
+	{
+		return kern.reset_timer(&m_timer, value);
+	}
+
 private:
 	kernel::timer m_timer;
 
@@ -56,27 +68,399 @@ private:
 };
 
 
-class timer_handler : public kernel_timer, public basic_handler {
+// Hierarchical timer wheel which keeps the timers of loop::add_timer
+// without a file descriptor each. A timer is put on the lowest of the
+// LEVELS wheels which covers its delay, and is moved down when the
+// lower wheel comes around; adding and removing a timer take constant
+// time. One kernel timer is armed to the next expiry, and its handler
+// submits the callbacks of the expired timers to the loop as tasks, so
+// that they run in parallel on the workers.
+//
+// Timers are identified by negative numbers so that they don't clash
+// with the file descriptors.
+class timer_wheel : public kernel_timer, public basic_handler {
 public:
-	timer_handler(kernel& kern, const timespec* value, const timespec* interval,
-			function<bool ()> callback) :
-		kernel_timer(kern, value, interval),
+	timer_wheel(loop_impl* lo, kernel& kern) :
+		kernel_timer(kern, NULL, NULL),  // disarmed
 		basic_handler(timer_ident(), this),
-		m_periodic(interval && (interval->tv_sec != 0 || interval->tv_nsec != 0)),
-		m_callback(callback)
-	{ }
+		m_loop(lo),
+		m_kernel(kern),
+		m_base(latency_clock()),
+		m_now(0),
+		m_armed(0),
+		m_free(NULL)
+	{
+		for(int l=0; l < LEVELS; ++l) {
+			m_count[l] = 0;
+			for(int i=0; i < SLOTS; ++i) {
+				m_slots[l][i].prev = m_slots[l][i].next = &m_slots[l][i];
+			}
+		}
+		m_chunks.reserve(MAX_CHUNKS);
+	}
+
+	~timer_wheel()
+	{
+		for(chunks_t::iterator it(m_chunks.begin());
+				it != m_chunks.end(); ++it) {
+			delete[] *it;
+		}
+	}
+
+	// value and interval are nanoseconds. the first expiry is after
+	// interval if value is 0, and the timer is disarmed if both are 0.
+	int add(uint64_t value, uint64_t interval, function<bool ()> callback)
+	{
+		uint64_t now = latency_clock();
+
+		pthread_scoped_lock lk(m_mutex);
+		entry* e = alloc();
+		e->callback.swap(callback);
+		e->interval = (interval + MP_WAVY_TIMER_TICK - 1) / MP_WAVY_TIMER_TICK;
+
+		if(value == 0) {
+			value = interval;
+		}
+		if(value == 0) {
+			e->state = STATE_IDLE;
+		} else {
+			// never earlier than value
+			e->expires = (now - m_base + value + MP_WAVY_TIMER_TICK - 1) /
+				MP_WAVY_TIMER_TICK;
+			schedule(e);
+		}
+
+		return -1 - (int)((e->gen << INDEX_BITS) | e->index);
+	}
+
+	void remove(int ident)
+	{
+		if(ident >= 0) {
+			return;
+		}
+		unsigned int id = (unsigned int)(-1 - ident);
+		unsigned int index = id & ((1 << INDEX_BITS) - 1);
+
+		function<bool ()> garbage;  // destructed out of the lock
+		pthread_scoped_lock lk(m_mutex);
+
+		if(index >= m_chunks.size() * CHUNK) {
+			return;
+		}
+		entry* e = &m_chunks[index / CHUNK][index % CHUNK];
+		if(e->gen != (id >> INDEX_BITS)) {
+			return;  // already freed
+		}
+
+		switch(e->state) {
+		case STATE_PENDING:
+			unlink(e);
+			release(e, garbage);
+			break;
+		case STATE_IDLE:
+			release(e, garbage);
+			break;
+		case STATE_FIRING:
+			e->state = STATE_CANCELED;  // freed after the callback
+			break;
+		}
+	}
+
+	bool operator() (event& ev)
+	{
+		read_timer(ev);
+
+		link fired;
+		fired.prev = fired.next = &fired;
+		{
+			pthread_scoped_lock lk(m_mutex);
+			m_armed = 0;
+			advance((latency_clock() - m_base) / MP_WAVY_TIMER_TICK, &fired);
+		}
+
+		std::vector<loop_impl::task_t> tasks;
+		for(link* x = fired.next; x != &fired; x = x->next) {
+			loop_impl::task_t t(fire_task(this, static_cast<entry*>(x)));
+			tasks.push_back(loop_impl::task_t());
+			tasks.back().swap(t);
+		}
+
+		{
+			pthread_scoped_lock lk(m_mutex);
+			uint64_t next = next_expiry();
+			if(next != 0 && (m_armed == 0 || next < m_armed)) {
+				arm(next);
+			}
+		}
+
+		if(!tasks.empty()) {
+			m_loop->submit_bulk(&tasks[0], tasks.size());
+		}
+		return true;
+	}
+
+private:
+	enum {
+		BITS   = 8,
+		SLOTS  = 1 << BITS,
+		LEVELS = 4,  // 2^32 ticks
+		CHUNK  = 4096,
+		INDEX_BITS = 22,
+		MAX_CHUNKS = (1 << INDEX_BITS) / CHUNK,
+		GEN_MASK   = (1 << (31 - INDEX_BITS)) - 1,
+	};
+
+	enum {
+		STATE_FREE,
+		STATE_IDLE,
+		STATE_PENDING,
+		STATE_FIRING,
+		STATE_CANCELED,
+	};
+
+	struct link {
+		link* prev;
+		link* next;
+	};
+
+	struct entry : link {
+		uint64_t expires;   // in ticks
+		uint64_t interval;  // in ticks, 0 if not periodic
+		function<bool ()> callback;
+		unsigned int index;
+		unsigned int gen;
+		int level;
+		int state;
+	};
+
+	// runs the callback of a fired entry on a worker
+	struct fire_task {
+		fire_task(timer_wheel* wheel, entry* e) : wheel(wheel), e(e) { }
+		timer_wheel* wheel;
+		entry* e;
+		void operator() () { wheel->fire(e); }
+	};
+
+	// the callback runs out of the lock so that it can add and
+	// remove timers. an entry removed while its task is queued is
+	// released without running the callback.
+	void fire(entry* e)
+	{
+		{
+			function<bool ()> garbage;
+			pthread_scoped_lock lk(m_mutex);
+			if(e->state == STATE_CANCELED) {
+				release(e, garbage);
+				return;
+			}
+		}
+
+		bool cont = false;
+		try {
+			cont = e->callback();
+		} catch (...) { }
 
-	~timer_handler() { }
+		function<bool ()> garbage;
+		pthread_scoped_lock lk(m_mutex);
+		if(cont && e->interval != 0 && e->state == STATE_FIRING) {
+			e->expires += e->interval;
+			schedule(e);
+		} else {
+			release(e, garbage);
+		}
+	}
 
-	bool operator() (event& e)
+	entry* alloc()
 	{
-		read_timer(e);
-		return m_callback() && m_periodic;
+		if(!m_free) {
+			if(m_chunks.size() >= MAX_CHUNKS) {
+				throw std::runtime_error("too many timers");
+			}
+			entry* chunk = new entry[CHUNK];
+			unsigned int base = m_chunks.size() * CHUNK;
+			m_chunks.push_back(chunk);  // reserved
+			for(unsigned int i=CHUNK; i > 0; --i) {
+				entry* e = &chunk[i-1];
+				e->index = base + i-1;
+				e->gen = 0;
+				e->state = STATE_FREE;
+				e->next = m_free;
+				m_free = e;
+			}
+		}
+		entry* e = m_free;
+		m_free = static_cast<entry*>(e->next);
+		return e;
+	}
+
+	void release(entry* e, function<bool ()>& garbage)
+	{
+		garbage.swap(e->callback);
+		e->gen = (e->gen + 1) & GEN_MASK;
+		e->state = STATE_FREE;
+		e->next = m_free;
+		m_free = e;
+	}
+
+	void schedule(entry* e)
+	{
+		if(e->expires <= m_now) {
+			e->expires = m_now + 1;
+		}
+		insert(e);
+		if(m_armed == 0 || e->expires < m_armed) {
+			arm(e->expires);
+		}
 	}
 
+	void insert(entry* e)
+	{
+		uint64_t at = e->expires;
+		uint64_t delta = at - m_now;
+		int level = 0;
+		while(level < LEVELS-1 && (delta >> (BITS*(level+1))) != 0) {
+			++level;
+		}
+		if((delta >> (BITS*LEVELS)) != 0) {
+			// moved down when the top wheel comes around
+			at = m_now + ((uint64_t)1 << (BITS*LEVELS)) - 1;
+		}
+
+		link* head = &m_slots[level][(at >> (BITS*level)) & (SLOTS-1)];
+		e->prev = head->prev;
+		e->next = head;
+		head->prev->next = e;
+		head->prev = e;
+		e->level = level;
+		e->state = STATE_PENDING;
+		++m_count[level];
+	}
+
+	void unlink(entry* e)
+	{
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		--m_count[e->level];
+	}
+
+	// moves timers expired by the tick to fired
+	void advance(uint64_t tick, link* fired)
+	{
+		while(m_now < tick) {
+			if(m_count[0] == 0) {
+				// skip to the next turn of an upper wheel which has timers
+				uint64_t next = next_expiry();
+				if(next == 0 || next > tick) {
+					m_now = tick;
+					break;
+				}
+				m_now = next;
+			} else {
+				++m_now;
+			}
+
+			if((m_now & (SLOTS-1)) == 0) {
+				cascade();
+			}
+
+			link* head = &m_slots[0][m_now & (SLOTS-1)];
+			for(link* x = head->next; x != head; x = x->next) {
+				static_cast<entry*>(x)->state = STATE_FIRING;
+				--m_count[0];
+			}
+			if(head->next != head) {
+				head->next->prev = fired->prev;
+				fired->prev->next = head->next;
+				head->prev->next = fired;
+				fired->prev = head->prev;
+				head->prev = head->next = head;
+			}
+		}
+	}
+
+	// moves the timers of the upper wheels which came around
+	void cascade()
+	{
+		int top = 1;
+		while(top < LEVELS-1 &&
+				(m_now & (((uint64_t)1 << (BITS*(top+1))) - 1)) == 0) {
+			++top;
+		}
+
+		for(int level=top; level > 0; --level) {
+			link* head = &m_slots[level][(m_now >> (BITS*level)) & (SLOTS-1)];
+			if(head->next == head) {
+				continue;
+			}
+			link* x = head->next;
+			head->prev->next = NULL;
+			head->prev = head->next = head;
+			while(x) {
+				entry* e = static_cast<entry*>(x);
+				x = x->next;
+				--m_count[level];
+				insert(e);
+			}
+		}
+	}
+
+	// returns the tick to wake up at, or 0 if no timers are pending
+	uint64_t next_expiry() const
+	{
+		uint64_t next = 0;
+		for(int level=0; level < LEVELS; ++level) {
+			if(m_count[level] == 0) {
+				continue;
+			}
+			// a slot of the upper wheels is moved down at its start
+			int shift = BITS*level;
+			for(uint64_t t = (m_now >> shift) + 1; ; ++t) {
+				const link* head = &m_slots[level][t & (SLOTS-1)];
+				if(head->next != head) {
+					if(next == 0 || (t << shift) < next) {
+						next = t << shift;
+					}
+					break;
+				}
+			}
+		}
+		return next;
+	}
+
+	void arm(uint64_t tick)
+	{
+		uint64_t at = m_base + tick * MP_WAVY_TIMER_TICK;
+		uint64_t now = latency_clock();
+		uint64_t ns = (at > now) ? at - now : 1;
+
+		struct timespec value = {
+			(time_t)(ns / 1000000000ULL), (long)(ns % 1000000000ULL) };
+		if(reset_timer(m_kernel, &value) < 0) {
+			throw system_error(errno, "failed to arm timer");
+		}
+		m_armed = tick;
+	}
+
+private:
+	loop_impl* m_loop;
+	kernel& m_kernel;
+
+	pthread_mutex m_mutex;
+
+	const uint64_t m_base;  // latency_clock() of tick 0
+	uint64_t m_now;    // ticks done
+	uint64_t m_armed;  // tick the kernel timer expires at, or 0
+
+	link m_slots[LEVELS][SLOTS];
+	size_t m_count[LEVELS];
+
+	typedef std::vector<entry*> chunks_t;
+	chunks_t m_chunks;  // entries are never moved
+	entry* m_free;
+
 private:
-	bool m_periodic;
-	function<bool ()> m_callback;
+	timer_wheel();
+	timer_wheel(const timer_wheel&);
 };
 
 
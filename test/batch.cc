@@ -0,0 +1,109 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// Dispatches events from many connections with different batch sizes.
+// Larger batches claim more events per acquisition of the loop's lock,
+// which is counted by stats().claims.
+
+static const int NUM_CONNS = 256;
+static const int NUM_ROUNDS = 200;
+
+static volatile int received = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd) : mp::wavy::handler(fd) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[512];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EINTR || errno == EAGAIN) { return; }
+			throw mp::system_error(errno, "read error");
+		}
+		__sync_add_and_fetch(&received, rl);
+	}
+};
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool bench(size_t batch, double* per_lock)
+{
+	mp::wavy::loop lo;
+	lo.set_dispatch_batch(batch);
+
+	int peers[NUM_CONNS];
+	for(int i=0; i < NUM_CONNS; ++i) {
+		int pair[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			perror("socketpair");
+			return false;
+		}
+		lo.add_handler<handler>(pair[0]);
+		peers[i] = pair[1];
+	}
+
+	received = 0;
+	lo.start(4);
+
+	double start = now();
+	for(int r=0; r < NUM_ROUNDS; ++r) {
+		for(int i=0; i < NUM_CONNS; ++i) {
+			if(::write(peers[i], "x", 1) != 1) {
+				perror("write");
+				return false;
+			}
+		}
+	}
+
+	for(int i=0; i < 10000 && received < NUM_CONNS*NUM_ROUNDS; ++i) {
+		usleep(1000);
+	}
+	double elapsed = now() - start;
+
+	lo.end();
+	lo.join();
+
+	for(int i=0; i < NUM_CONNS; ++i) {
+		::close(peers[i]);
+	}
+
+	mp::wavy::loop::statistics st = lo.stats();
+	*per_lock = st.claims ? (double)st.polled / st.claims : 0.0;
+
+	std::cout << "batch " << batch << ": "
+		<< received << " bytes in " << elapsed << " sec, "
+		<< (received / elapsed) << " bytes/sec, "
+		<< st.polled << " events in " << st.claims << " lock acquisitions, "
+		<< *per_lock << " events/lock" << std::endl;
+
+	return received == NUM_CONNS*NUM_ROUNDS;
+}
+
+int main(void)
+{
+	bool ok = true;
+	double single, batch16, batch64;
+	ok = bench(1, &single) && ok;
+	ok = bench(16, &batch16) && ok;
+	ok = bench(64, &batch64) && ok;
+
+	// a batch of 1 takes the lock for every event; larger batches
+	// take it fewer times for the same events
+	return (ok && batch16 > single && batch64 > single) ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// A handler which drains its socket stops when the read budget is used
+// up, and the loop runs the other ready handlers before it resumes.
+
+static const int FIREHOSE_BYTES = 64*1024;
+static const size_t BUDGET = 1024;
+
+static volatile int firehose_received = 0;
+static volatile int firehose_at_other = -1;  // when the other one ran
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd, bool firehose) :
+		mp::wavy::handler(fd), m_firehose(firehose) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		while(!e.exhausted()) {
+			char buf[256];
+			ssize_t rl = read(fd(), buf, sizeof(buf));
+			if(rl <= 0) {
+				if(rl == 0) {
+					throw mp::system_error(errno, "connection closed");
+				}
+				if(errno == EINTR || errno == EAGAIN) { return; }
+				throw mp::system_error(errno, "read error");
+			}
+			e.consume(rl);
+			if(m_firehose) {
+				__sync_add_and_fetch(&firehose_received, rl);
+			} else {
+				firehose_at_other = firehose_received;
+			}
+		}
+	}
+
+private:
+	bool m_firehose;
+};
+
+static bool fill(int fd, size_t len)
+{
+	char buf[4096] = {};
+	while(len > 0) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+		if(write(fd, buf, n) != (ssize_t)n) {
+			perror("write");
+			return false;
+		}
+		len -= n;
+	}
+	return true;
+}
+
+int main(void)
+{
+	int hose[2];
+	int other[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, hose) < 0 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, other) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	if(!fill(hose[1], FIREHOSE_BYTES) || !fill(other[1], 1)) {
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.set_read_budget(BUDGET);
+	lo.add_handler<handler>(hose[0], true);
+	lo.add_handler<handler>(other[0], false);
+	lo.start(1);
+
+	for(int i=0; i < 5000 && (firehose_received < FIREHOSE_BYTES ||
+				firehose_at_other < 0); ++i) {
+		usleep(1000);
+	}
+
+	mp::wavy::loop::statistics st = lo.stats();
+
+	std::cout
+		<< "firehose " << firehose_received << ", "
+		<< "firehose when the other ran " << firehose_at_other << ", "
+		<< "budget_requeue " << st.budget_requeue << std::endl;
+
+	lo.end();
+	lo.join();
+
+	return (firehose_received == FIREHOSE_BYTES &&
+			firehose_at_other >= 0 &&
+			firehose_at_other <= (int)BUDGET &&
+			st.budget_requeue >= FIREHOSE_BYTES / BUDGET - 1) ? 0 : 1;
+}
+
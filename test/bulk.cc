@@ -0,0 +1,99 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/time.h>
+#include <vector>
+#include <iostream>
+
+// submit_bulk runs every task of the batch, from outside and from inside
+// of a worker, and is compared with submitting the tasks one by one.
+
+static const int FANOUT = 64;
+static const int ROUNDS = 2000;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void task(volatile int* count)
+{
+	__sync_add_and_fetch(count, 1);
+}
+
+struct make_task {
+	make_task(volatile int* count) : m_count(count) { }
+	mp::function<void ()> operator() (size_t) const
+	{
+		return mp::bind(&task, m_count);
+	}
+	volatile int* m_count;
+};
+
+static void fanout(mp::wavy::loop* lo, volatile int* count)
+{
+	lo->submit_bulk(FANOUT, make_task(count));
+}
+
+static double bench_single(mp::wavy::loop& lo, volatile int* count)
+{
+	double start = now();
+	for(int r=0; r < ROUNDS; ++r) {
+		for(int i=0; i < FANOUT; ++i) {
+			lo.submit(&task, count);
+		}
+		lo.flush();
+	}
+	return now() - start;
+}
+
+static double bench_bulk(mp::wavy::loop& lo, volatile int* count)
+{
+	std::vector< mp::function<void ()> > tasks(FANOUT, mp::bind(&task, count));
+	double start = now();
+	for(int r=0; r < ROUNDS; ++r) {
+		lo.submit_bulk(tasks.begin(), tasks.end());
+		lo.flush();
+	}
+	return now() - start;
+}
+
+int main(void)
+{
+	mp::wavy::loop lo;
+	lo.start(4);
+
+	volatile int count = 0;
+	std::vector< mp::function<void ()> > tasks(100, mp::bind(&task, &count));
+	lo.submit_bulk(tasks.begin(), tasks.end());
+	lo.submit_bulk(100, make_task(&count));
+	lo.flush();
+
+	volatile int fanout_count = 0;
+	for(int i=0; i < 100; ++i) {
+		lo.submit(&fanout, &lo, &fanout_count);
+	}
+	lo.flush();
+
+	std::cout << count << " tasks, "
+		<< fanout_count << " fan-out tasks" << std::endl;
+	bool ok = (count == 200 && fanout_count == 100*FANOUT);
+
+	volatile int single_count = 0;
+	volatile int bulk_count = 0;
+	double single = bench_single(lo, &single_count);
+	double bulk = bench_bulk(lo, &bulk_count);
+
+	std::cout << "submit x " << FANOUT << ": "
+		<< single / ROUNDS * 1e6 << " usec per round" << std::endl;
+	std::cout << "submit_bulk of " << FANOUT << ": "
+		<< bulk / ROUNDS * 1e6 << " usec per round" << std::endl;
+	ok = ok && single_count == ROUNDS*FANOUT && bulk_count == ROUNDS*FANOUT;
+
+	lo.end();
+	lo.join();
+
+	return ok ? 0 : 1;
+}
+
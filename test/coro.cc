@@ -0,0 +1,117 @@
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+#include <mp/wavy_coro.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+#include <iostream>
+
+// Coroutines wait for a socket, a timer, a connection and a write
+// with the awaitables of mp/wavy_coro.h.
+
+using namespace mp::wavy;
+
+static volatile int finished = 0;
+static volatile int failed = 0;
+
+static coro::task<int> read_some(loop& lo, int fd, char* buf, size_t size)
+{
+	while(true) {
+		co_await coro::readable(lo, fd);
+		ssize_t rl = ::read(fd, buf, size);
+		if(rl < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		co_return (int)rl;
+	}
+}
+
+// replies what it reads, after a short sleep
+static coro::task<void> echo(loop& lo, int fd)
+{
+	char buf[64];
+	int n = co_await read_some(lo, fd, buf, sizeof(buf));
+	if(n <= 0) {
+		__sync_add_and_fetch(&failed, 1);
+		co_return;
+	}
+	co_await coro::sleep(lo, 0.01);
+	co_await coro::writable(lo, fd);
+	co_await coro::write(lo, fd, buf, n);
+	__sync_add_and_fetch(&finished, 1);
+}
+
+static coro::task<void> client(loop& lo, struct sockaddr_in addr)
+{
+	int fd = co_await coro::connect(lo, PF_INET, SOCK_STREAM, 0,
+			(struct sockaddr*)&addr, sizeof(addr), 1.0);
+	const char msg[] = "hello";
+	co_await coro::write(lo, fd, msg, sizeof(msg));
+	char buf[64];
+	int n = co_await read_some(lo, fd, buf, sizeof(buf));
+	if(n != (int)sizeof(msg) || memcmp(buf, msg, n) != 0) {
+		__sync_add_and_fetch(&failed, 1);
+	}
+	::close(fd);
+	__sync_add_and_fetch(&finished, 1);
+}
+
+static void accepted(loop* lo, int fd, int /*err*/)
+{
+	if(fd < 0) {
+		__sync_add_and_fetch(&failed, 1);
+		return;
+	}
+	coro::spawn(*lo, echo(*lo, fd));
+}
+
+int main(void)
+{
+	loop lo;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	int lsock = lo.listen(PF_INET, SOCK_STREAM, 0,
+			(struct sockaddr*)&addr, sizeof(addr),
+			mp::bind(&accepted, &lo, mp::placeholders::_1, mp::placeholders::_2));
+	socklen_t len = sizeof(addr);
+	if(getsockname(lsock, (struct sockaddr*)&addr, &len) < 0) {
+		perror("getsockname");
+		return 1;
+	}
+
+	lo.start(2);
+
+	static const int NUM = 4;
+	for(int i=0; i < NUM; ++i) {
+		coro::spawn(lo, client(lo, addr));
+	}
+
+	for(int i=0; i < 5000 && finished < NUM*2 && failed == 0; ++i) {
+		usleep(1000);
+	}
+
+	std::cout << finished << " coroutines finished, "
+		<< failed << " failed" << std::endl;
+
+	lo.end();
+	lo.join();
+
+	return (finished == NUM*2 && failed == 0) ? 0 : 1;
+}
+
+#else
+#include <iostream>
+
+int main(void)
+{
+	std::cout << "C++20 coroutines are not available" << std::endl;
+	return 77;  // skipped
+}
+#endif
+
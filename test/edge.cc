@@ -0,0 +1,99 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+static const int NUM_PAIRS = 32;
+static const int NUM_ROUNDS = 500;
+static volatile int received = 0;
+static volatile int overlapped = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd) :
+		mp::wavy::handler(fd),
+		m_running(0)
+	{
+		set_edge_triggered();
+	}
+
+	void on_read(mp::wavy::event& e)
+	{
+		if(__sync_add_and_fetch(&m_running, 1) != 1) {
+			__sync_add_and_fetch(&overlapped, 1);
+		}
+
+		// edge-triggered: read until EAGAIN
+		while(true) {
+			char buf[64];
+			ssize_t rl = read(fd(), buf, sizeof(buf));
+			if(rl <= 0) {
+				if(rl == 0) {
+					__sync_sub_and_fetch(&m_running, 1);
+					throw mp::system_error(errno, "connection closed");
+				}
+				if(errno == EINTR) { continue; }
+				if(errno == EAGAIN) { break; }
+				__sync_sub_and_fetch(&m_running, 1);
+				throw mp::system_error(errno, "read error");
+			}
+			__sync_add_and_fetch(&received, rl);
+		}
+
+		__sync_sub_and_fetch(&m_running, 1);
+	}
+
+private:
+	volatile int m_running;
+};
+
+int main(void)
+{
+	mp::wavy::loop lo;
+
+	int peers[NUM_PAIRS];
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		int pair[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		lo.add_handler<handler>(pair[0]);
+		peers[i] = pair[1];
+	}
+
+	lo.start(8);
+
+	for(int r=0; r < NUM_ROUNDS; ++r) {
+		for(int i=0; i < NUM_PAIRS; ++i) {
+			if(write(peers[i], "x", 1) != 1) {
+				perror("write");
+				return 1;
+			}
+		}
+	}
+
+	const int expected = NUM_PAIRS * NUM_ROUNDS;
+	for(int i=0; i < 1000 && received < expected; ++i) {
+		usleep(10*1000);
+	}
+
+	lo.end();
+	lo.join();
+
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		close(peers[i]);
+	}
+
+	std::cout << "received " << received << " bytes, "
+		<< overlapped << " overlapped calls" << std::endl;
+
+	if(received != expected || overlapped != 0) {
+		return 1;
+	}
+	return 0;
+}
+
@@ -0,0 +1,141 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+
+// Worker threads are retired by remove_thread and restarted by add_thread.
+// The autoscaler grows the pool while tasks are queued and shrinks it
+// again when the threads are idle.
+
+static int count_threads_named(const char* prefix)
+{
+	int n = 0;
+	DIR* dir = opendir("/proc/self/task");
+	if(!dir) {
+		return -1;  // no procfs
+	}
+	while(struct dirent* ent = readdir(dir)) {
+		if(ent->d_name[0] == '.') { continue; }
+		std::string path = std::string("/proc/self/task/") + ent->d_name + "/comm";
+		FILE* f = fopen(path.c_str(), "r");
+		if(!f) { continue; }
+		char buf[64] = "";
+		if(fgets(buf, sizeof(buf), f) && strncmp(buf, prefix, strlen(prefix)) == 0 &&
+				strncmp(buf + strlen(prefix), "scale", 5) != 0) {
+			++n;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return n;
+}
+
+static volatile bool released = false;
+static volatile int count = 0;
+
+static void task()
+{
+	__sync_add_and_fetch(&count, 1);
+}
+
+static void blocking_task()
+{
+	while(!released) {
+		usleep(1000);
+	}
+	__sync_add_and_fetch(&count, 1);
+}
+
+template <typename Pred>
+static bool wait_until(Pred pred)
+{
+	for(int i=0; i < 3000; ++i) {
+		if(pred()) { return true; }
+		usleep(1000);
+	}
+	return false;
+}
+
+static mp::wavy::loop* s_lo;
+static size_t s_expect;
+
+static bool num_threads_is()
+{
+	return s_lo->num_threads() == s_expect;
+}
+
+static bool alive_threads_is()
+{
+	int n = count_threads_named("wavy-");
+	return n < 0 || n == (int)s_expect;
+}
+
+static bool num_threads_at_least()
+{
+	return s_lo->num_threads() >= s_expect;
+}
+
+int main(void)
+{
+	bool ok = true;
+
+	mp::wavy::loop lo;
+	s_lo = &lo;
+	lo.start(4);
+
+	// shrink
+	lo.remove_thread(3);
+	s_expect = 1;
+	ok = wait_until(&num_threads_is) && wait_until(&alive_threads_is) && ok;
+	std::cout << "removed: " << lo.num_threads() << " threads, "
+		<< count_threads_named("wavy-") << " alive" << std::endl;
+
+	for(int i=0; i < 100; ++i) {
+		lo.submit(&task);
+	}
+	lo.flush();
+	ok = (count == 100) && ok;
+
+	// grow again on the retired contexts
+	lo.add_thread(2);
+	s_expect = 3;
+	ok = wait_until(&num_threads_is) && wait_until(&alive_threads_is) && ok;
+	ok = (lo.worker_cpus().size() == 4) && ok;
+	std::cout << "added: " << lo.num_threads() << " threads, "
+		<< count_threads_named("wavy-") << " alive" << std::endl;
+
+	// autoscale
+	lo.remove_thread(2);
+	lo.set_autoscale(mp::wavy::loop::autoscale(1, 4, 0.01));
+
+	count = 0;
+	for(int i=0; i < 16; ++i) {
+		lo.submit(&blocking_task);
+	}
+	s_expect = 4;
+	bool grown = wait_until(&num_threads_at_least);
+	std::cout << "busy: " << lo.num_threads() << " threads" << std::endl;
+
+	released = true;
+	lo.flush();
+	ok = (count == 16) && ok;
+
+	s_expect = 1;
+	bool shrunk = wait_until(&num_threads_is) && wait_until(&alive_threads_is);
+	std::cout << "idle: " << lo.num_threads() << " threads, "
+		<< count_threads_named("wavy-") << " alive" << std::endl;
+	ok = grown && shrunk && ok;
+
+	lo.end();
+	lo.join();
+	ok = !lo.is_running() && ok;
+
+	return ok ? 0 : 1;
+}
+
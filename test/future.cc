@@ -0,0 +1,99 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <iostream>
+#include <vector>
+
+// loop::submit_with_result() returns a future. Continuations run on the
+// worker which completes it, and when_all() gathers the results.
+
+static const int NUM = 100;
+
+static pthread_t main_thread;
+static volatile int continued_on_worker = 0;
+
+static int square(int i)
+{
+	return i * i;
+}
+
+static int slow(int i)
+{
+	usleep(20*1000);
+	return i;
+}
+
+static int fail()
+{
+	throw std::runtime_error("expected error");
+}
+
+static int sum(const std::vector<int>& v)
+{
+	int s = 0;
+	for(size_t i=0; i < v.size(); ++i) {
+		s += v[i];
+	}
+	return s;
+}
+
+static int plus_one(int i)
+{
+	if(!pthread_equal(pthread_self(), main_thread)) {
+		continued_on_worker = 1;
+	}
+	return i + 1;
+}
+
+int main(void)
+{
+	main_thread = pthread_self();
+	bool ok = true;
+
+	mp::wavy::loop lo;
+	lo.start(4);
+
+	// fan-out and fan-in
+	std::vector<mp::future<int> > squares;
+	int expected = 0;
+	for(int i=0; i < NUM; ++i) {
+		squares.push_back(lo.submit_with_result<int>(&square, i));
+		expected += i * i;
+	}
+	mp::future<int> total = mp::when_all(squares.begin(), squares.end())
+		.then<int>(&sum);
+	int got = total.get();
+	std::cout << "sum of squares " << got << std::endl;
+	if(got != expected) { ok = false; }
+
+	// a continuation added before completion runs on the worker
+	mp::future<int> later = lo.submit_with_result<int>(&slow, 41)
+		.then<int>(&plus_one);
+	got = later.get();
+	std::cout << "then " << got << ", on worker " << continued_on_worker << std::endl;
+	if(got != 42 || !continued_on_worker) { ok = false; }
+
+	// errors skip the continuations
+	mp::future<int> failed = lo.submit_with_result<int>(&fail)
+		.then<int>(&plus_one);
+	try {
+		failed.get();
+		ok = false;
+	} catch (std::runtime_error& e) {
+		std::cout << "error " << e.what() << std::endl;
+	}
+
+	// a promise set by hand
+	mp::promise<int> p;
+	mp::future<int> f = p.get_future();
+	p.set_value(7);
+	if(!f.is_ready() || f.then<int>(&plus_one).get() != 8) { ok = false; }
+
+	lo.end();
+	lo.join();
+
+	return ok ? 0 : 1;
+}
+
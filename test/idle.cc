@@ -0,0 +1,70 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// Measures the latency from submit() to the start of the task while the
+// workers are idle, with different idle policies. Parked workers have to
+// be woken with a futex; spinning ones pick the task up directly.
+
+static const int NUM_SAMPLES = 2000;
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void task(volatile double* started)
+{
+	*started = now();
+}
+
+static bool bench(const char* name, mp::wavy::loop::idle_policy policy)
+{
+	mp::wavy::loop lo;
+	lo.set_idle_policy(policy);
+	lo.start(4);
+
+	double total = 0;
+	int done = 0;
+	for(int i=0; i < NUM_SAMPLES; ++i) {
+		usleep(100);  // let the workers go idle
+
+		volatile double started = 0;
+		double submitted = now();
+		lo.submit(&task, &started);
+
+		for(int t=0; t < 1000000 && started == 0; ++t) {
+			sched_yield();
+		}
+		if(started == 0) {
+			break;
+		}
+		total += started - submitted;
+		++done;
+	}
+
+	lo.end();
+	lo.join();
+
+	std::cout << name << ": " << done << " wakeups, "
+		<< (done ? total / done * 1e6 : 0) << " usec average latency"
+		<< std::endl;
+
+	return done == NUM_SAMPLES;
+}
+
+int main(void)
+{
+	typedef mp::wavy::loop::idle_policy idle_policy;
+	bool ok = true;
+	ok = bench("park", idle_policy()) && ok;
+	ok = bench("yield", idle_policy(0, 1000)) && ok;
+	ok = bench("spin", idle_policy(100000, 0)) && ok;
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,115 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Handler latency histograms are kept by the type of the handler.
+// Without --enable-handler-latency nothing is recorded.
+
+static const int NUM_EVENTS = 20;
+
+static volatile int received = 0;
+
+class fast_handler : public mp::wavy::handler {
+public:
+	fast_handler(int fd) : mp::wavy::handler(fd) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[1];
+		if(read(fd(), buf, sizeof(buf)) == 1) {
+			__sync_add_and_fetch(&received, 1);
+		}
+	}
+};
+
+class slow_handler : public mp::wavy::handler {
+public:
+	slow_handler(int fd) : mp::wavy::handler(fd) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[1];
+		if(read(fd(), buf, sizeof(buf)) == 1) {
+			usleep(2000);
+			__sync_add_and_fetch(&received, 1);
+		}
+	}
+};
+
+#ifdef ENABLE_HANDLER_LATENCY
+static const mp::wavy::loop::handler_latency* find(
+		const std::vector<mp::wavy::loop::handler_latency>& result,
+		const char* name)
+{
+	for(size_t i=0; i < result.size(); ++i) {
+		if(result[i].type.find(name) != std::string::npos) {
+			return &result[i];
+		}
+	}
+	return NULL;
+}
+#endif
+
+int main(void)
+{
+	int fast[2];
+	int slow[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fast) < 0 ||
+			socketpair(AF_UNIX, SOCK_STREAM, 0, slow) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.add_handler<fast_handler>(fast[0]);
+	lo.add_handler<slow_handler>(slow[0]);
+	lo.start(2);
+
+	for(int i=0; i < NUM_EVENTS; ++i) {
+		if(::write(fast[1], "x", 1) != 1 || ::write(slow[1], "x", 1) != 1) {
+			perror("write");
+			return 1;
+		}
+		usleep(5000);
+	}
+	for(int i=0; i < 5000 && received < NUM_EVENTS*2; ++i) {
+		usleep(1000);
+	}
+
+	std::vector<mp::wavy::loop::handler_latency> result = lo.handler_latencies();
+
+	lo.end();
+	lo.join();
+
+	for(size_t i=0; i < result.size(); ++i) {
+		const mp::wavy::loop::handler_latency& h(result[i]);
+		std::cout << h.type << ": "
+			<< h.run.count << " runs, "
+			<< "run p50 " << h.run.percentile(50) << " ns, "
+			<< "run max " << h.run.max << " ns, "
+			<< "dispatch p99 " << h.dispatch.percentile(99) << " ns"
+			<< std::endl;
+	}
+
+#ifdef ENABLE_HANDLER_LATENCY
+	const mp::wavy::loop::handler_latency* f = find(result, "fast_handler");
+	const mp::wavy::loop::handler_latency* s = find(result, "slow_handler");
+	if(!f || !s) {
+		return 1;
+	}
+	return (f->run.count == NUM_EVENTS && s->run.count == NUM_EVENTS &&
+			s->run.percentile(50) >= 1000000 &&
+			f->run.percentile(50) < s->run.percentile(50) &&
+			f->dispatch.count > 0) ? 0 : 1;
+#else
+	std::cout << "handler latency is disabled" << std::endl;
+	return (received == NUM_EVENTS*2 && result.empty()) ? 0 : 1;
+#endif
+}
+
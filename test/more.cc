@@ -0,0 +1,82 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// event::more() within loop::set_more_budget() runs the handler again
+// on the same thread, without putting the event back to the loop.
+
+static const int NUM_BYTES = 100;
+
+static volatile int received = 0;
+static volatile int moved = 0;  // handler ran on another thread
+static pthread_t last;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd) : mp::wavy::handler(fd) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char c;
+		ssize_t rl = read(fd(), &c, 1);
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EINTR || errno == EAGAIN) { return; }
+			throw mp::system_error(errno, "read error");
+		}
+		if(received > 0 && !pthread_equal(last, pthread_self())) {
+			++moved;
+		}
+		last = pthread_self();
+		++received;
+		e.more();  // one byte per turn
+	}
+};
+
+int main(void)
+{
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	char buf[NUM_BYTES] = {};
+	if(write(pair[1], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+		perror("write");
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.set_more_budget(NUM_BYTES * 2);
+	lo.add_handler<handler>(pair[0]);
+	lo.start(4);
+
+	for(int i=0; i < 5000 && received < NUM_BYTES; ++i) {
+		usleep(1000);
+	}
+
+	mp::wavy::loop::statistics st = lo.stats();
+
+	std::cout
+		<< "received " << received << ", "
+		<< "moved "    << moved << ", "
+		<< "events "   << st.events << ", "
+		<< "more "     << st.more << std::endl;
+
+	lo.end();
+	lo.join();
+
+	return (received == NUM_BYTES &&
+			moved == 0 &&
+			st.more == 0 &&
+			st.events >= (uint64_t)NUM_BYTES) ? 0 : 1;
+}
+
@@ -0,0 +1,100 @@
+#include <mp/wavy.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+// Writes which can't be done at once are queued and written in order,
+// across writevs and a sendfile, and each finalizer runs after the
+// data before it is written.
+
+static const size_t CHUNK = 64*1024;
+static const size_t CHUNKS = 64;
+static const size_t FILE_SIZE = 256*1024;
+static const size_t TOTAL = CHUNK*CHUNKS + FILE_SIZE;
+
+static char* src;
+
+static size_t received = 0;
+static volatile int finalized = 0;
+static volatile bool out_of_order = false;
+
+static void finalize(void* user)
+{
+	if(__sync_add_and_fetch(&finalized, 1) != (int)(size_t)user) {
+		out_of_order = true;
+	}
+}
+
+int main(void)
+{
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	fcntl(pair[0], F_SETFL, O_NONBLOCK);
+
+	src = (char*)malloc(TOTAL);
+	for(size_t i=0; i < TOTAL; ++i) {
+		src[i] = (char)(i * 7 % 251);
+	}
+
+	// the sendfile goes in the middle
+	const size_t file_off = CHUNK * (CHUNKS/2);
+	FILE* tmp = tmpfile();
+	if(!tmp || fwrite(src + file_off, 1, FILE_SIZE, tmp) != FILE_SIZE ||
+			fflush(tmp) != 0) {
+		perror("tmpfile");
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.start(2);
+
+	size_t off = 0;
+	for(size_t i=0; i < CHUNKS; ++i) {
+		if(off == file_off) {
+			lo.sendfile(pair[0], fileno(tmp), 0, FILE_SIZE, NULL, NULL);
+			off += FILE_SIZE;
+		}
+		struct iovec vec[2];
+		vec[0].iov_base = src + off;
+		vec[0].iov_len  = CHUNK/2;
+		vec[1].iov_base = src + off + CHUNK/2;
+		vec[1].iov_len  = CHUNK/2;
+		off += CHUNK;
+		lo.writev(pair[0], vec, 2, &finalize, (void*)(i+1));
+	}
+
+	char* dst = (char*)malloc(TOTAL);
+	while(received < TOTAL) {
+		ssize_t rl = read(pair[1], dst + received, TOTAL - received);
+		if(rl <= 0) {
+			perror("read");
+			return 1;
+		}
+		received += rl;
+	}
+
+	lo.flush();
+	lo.end();
+	lo.join();
+
+	bool same = memcmp(src, dst, TOTAL) == 0;
+	mp::wavy::loop::statistics st = lo.stats();
+
+	std::cout
+		<< "received " << received << ", "
+		<< "finalized " << finalized << ", "
+		<< "bytes_written " << st.bytes_written << ", "
+		<< "write_again " << st.write_again << std::endl;
+
+	return (same && !out_of_order && finalized == (int)CHUNKS &&
+			st.bytes_written == TOTAL) ? 0 : 1;
+}
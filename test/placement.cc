@@ -0,0 +1,72 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+
+// Workers started with a placement are pinned to the given CPUs
+// and named after it.
+
+static int count_threads_named(const char* prefix)
+{
+	int n = 0;
+	DIR* dir = opendir("/proc/self/task");
+	if(!dir) {
+		return -1;  // no procfs
+	}
+	while(struct dirent* ent = readdir(dir)) {
+		if(ent->d_name[0] == '.') { continue; }
+		std::string path = std::string("/proc/self/task/") + ent->d_name + "/comm";
+		FILE* f = fopen(path.c_str(), "r");
+		if(!f) { continue; }
+		char buf[64] = "";
+		if(fgets(buf, sizeof(buf), f) && strncmp(buf, prefix, strlen(prefix)) == 0) {
+			++n;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return n;
+}
+
+int main(void)
+{
+	mp::wavy::loop::placement pl = mp::wavy::loop::placement::per_core();
+	pl.name = "wtest";
+	if(pl.cpus.empty()) {
+		std::cout << "no cpu found" << std::endl;
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.start(3, pl);
+	usleep(50*1000);  // workers pin and name themselves
+
+	std::vector<int> cpus = lo.worker_cpus();
+	std::cout << cpus.size() << " workers on cpus";
+	bool ok = (cpus.size() == 3);
+	for(size_t i=0; i < cpus.size(); ++i) {
+		std::cout << " " << cpus[i];
+		if(cpus[i] != pl.cpus[i % pl.cpus.size()]) {
+			ok = false;
+		}
+	}
+	std::cout << std::endl;
+
+	int named = count_threads_named("wtest-");
+	std::cout << named << " threads named wtest-N" << std::endl;
+	if(named >= 0 && named != 3) {
+		ok = false;
+	}
+
+	lo.end();
+	lo.join();
+
+	return ok ? 0 : 1;
+}
+
@@ -0,0 +1,80 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <vector>
+#include <iostream>
+
+// Tasks queued behind a busy worker run in the order of their priority:
+// high priority tasks before any normal one, and low priority tasks after
+// the normal ones.
+
+static const int NUM_TASKS = 100;
+
+static volatile bool released = false;
+static volatile int order = 0;
+static int ran[3][NUM_TASKS];
+
+void gate()
+{
+	while(!released) {
+		usleep(1000);
+	}
+}
+
+void task(int prio, int n)
+{
+	ran[prio][n] = __sync_add_and_fetch(&order, 1);
+}
+
+int main(void)
+{
+	typedef mp::wavy::loop loop;
+
+	loop lo;
+	lo.start(1);
+
+	lo.submit(&gate);
+	usleep(10*1000);  // let the worker block in gate()
+
+	for(int i=0; i < NUM_TASKS; ++i) {
+		lo.submit(loop::PRIORITY_LOW, &task, (int)loop::PRIORITY_LOW, i);
+		lo.submit(loop::PRIORITY_NORMAL, &task, (int)loop::PRIORITY_NORMAL, i);
+		lo.submit(loop::PRIORITY_HIGH, &task, (int)loop::PRIORITY_HIGH, i);
+	}
+
+	released = true;
+	lo.flush();
+
+	lo.end();
+	lo.join();
+
+	int last_high = 0;
+	int first_normal = NUM_TASKS*3 + 1;
+	int last_normal = 0;
+	int first_low = NUM_TASKS*3 + 1;
+	for(int i=0; i < NUM_TASKS; ++i) {
+		if(ran[loop::PRIORITY_HIGH][i] > last_high) {
+			last_high = ran[loop::PRIORITY_HIGH][i];
+		}
+		if(ran[loop::PRIORITY_NORMAL][i] < first_normal) {
+			first_normal = ran[loop::PRIORITY_NORMAL][i];
+		}
+		if(ran[loop::PRIORITY_NORMAL][i] > last_normal) {
+			last_normal = ran[loop::PRIORITY_NORMAL][i];
+		}
+		if(ran[loop::PRIORITY_LOW][i] < first_low) {
+			first_low = ran[loop::PRIORITY_LOW][i];
+		}
+	}
+
+	std::cout << order << " tasks, "
+		<< "last high " << last_high << ", "
+		<< "normal " << first_normal << "-" << last_normal << ", "
+		<< "first low " << first_low << std::endl;
+
+	return (order == NUM_TASKS*3 &&
+			last_high < first_normal &&
+			last_high < first_low) ? 0 : 1;
+}
+
@@ -0,0 +1,128 @@
+#include <mp/wavy.h>
+#include <mp/pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <deque>
+#include <iostream>
+
+// Handlers of set_recv_buffered() take the data of their fd in order
+// with event::recv(), and see the end of the stream. Some buffers are
+// kept for a while, so that the buffers of the kernel run short.
+
+static const size_t CONNS = 16;
+static const size_t BYTES = 256*1024;
+static const size_t HOLD = 200;  // buffers kept by the handlers
+
+static mp::pthread_mutex hold_mutex;
+static std::deque<mp::wavy::recv_buffer> held;
+
+static volatile int finished = 0;
+static volatile bool corrupted = false;
+static volatile size_t received = 0;
+
+static char pattern(size_t conn, size_t off)
+{
+	return (char)((off + conn) % 251);
+}
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd, size_t conn) :
+		mp::wavy::handler(fd), m_conn(conn), m_off(0)
+	{
+		set_recv_buffered();
+	}
+
+	void on_read(mp::wavy::event& e)
+	{
+		while(true) {
+			mp::wavy::recv_buffer buf;
+			ssize_t rl = e.recv(&buf);
+			if(rl <= 0) {
+				if(rl < 0 && (errno == EAGAIN || errno == EINTR)) {
+					return;
+				}
+				if(rl < 0 || m_off != BYTES) {
+					corrupted = true;
+				}
+				__sync_add_and_fetch(&finished, 1);
+				e.remove();
+				return;
+			}
+
+			if((size_t)rl != buf.size()) {
+				corrupted = true;
+			}
+			for(size_t i=0; i < buf.size(); ++i) {
+				if(buf.data()[i] != pattern(m_conn, m_off + i)) {
+					corrupted = true;
+					break;
+				}
+			}
+			m_off += buf.size();
+			__sync_add_and_fetch(&received, buf.size());
+
+			mp::pthread_scoped_lock lk(hold_mutex);
+			held.push_back(buf);
+			if(held.size() > HOLD) {
+				held.pop_front();
+			}
+		}
+	}
+
+private:
+	size_t m_conn;
+	size_t m_off;
+};
+
+int main(void)
+{
+	int pairs[CONNS][2];
+
+	mp::wavy::loop lo;
+	for(size_t c=0; c < CONNS; ++c) {
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[c]) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		lo.add_handler<handler>(pairs[c][0], c);
+	}
+	lo.start(2);
+
+	char buf[4096];
+	for(size_t off=0; off < BYTES; off += sizeof(buf)) {
+		for(size_t c=0; c < CONNS; ++c) {
+			for(size_t i=0; i < sizeof(buf); ++i) {
+				buf[i] = pattern(c, off + i);
+			}
+			if(write(pairs[c][1], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+				perror("write");
+				return 1;
+			}
+		}
+	}
+	for(size_t c=0; c < CONNS; ++c) {
+		close(pairs[c][1]);
+	}
+
+	for(int i=0; i < 5000 && finished < (int)CONNS; ++i) {
+		usleep(1000);
+	}
+
+	std::cout
+		<< "received " << received << ", "
+		<< "finished " << finished << std::endl;
+
+	{
+		mp::pthread_scoped_lock lk(hold_mutex);
+		held.clear();
+	}
+
+	lo.end();
+	lo.join();
+
+	return (!corrupted && finished == (int)CONNS &&
+			received == CONNS * BYTES) ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+static const int NUM_PAIRS = 64;
+static volatile int received = 0;
+static volatile int destructed = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd) :
+		mp::wavy::handler(fd) { }
+
+	~handler()
+	{
+		__sync_add_and_fetch(&destructed, 1);
+	}
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[512];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EINTR || errno == EAGAIN) { return; }
+			throw mp::system_error(errno, "read error");
+		}
+
+		__sync_add_and_fetch(&received, rl);
+	}
+};
+
+int main(void)
+{
+	mp::wavy::loop lo;
+
+	int fds[NUM_PAIRS];
+	int peers[NUM_PAIRS];
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		int pair[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		lo.add_handler<handler>(pair[0]);
+		fds[i] = pair[0];
+		peers[i] = pair[1];
+	}
+
+	lo.start(4);
+
+	for(int r=0; r < 100; ++r) {
+		for(int i=0; i < NUM_PAIRS; ++i) {
+			if(write(peers[i], "x", 1) != 1) {
+				perror("write");
+				return 1;
+			}
+		}
+	}
+
+	// remove the handlers while their events are dispatched
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		lo.remove_handler(fds[i]);
+	}
+
+	// removed handlers are destroyed once no worker can see them
+	for(int i=0; i < 500 && destructed < NUM_PAIRS; ++i) {
+		usleep(10*1000);
+	}
+
+	lo.end();
+	lo.join();
+
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		close(peers[i]);
+	}
+
+	std::cout << received << " bytes received, "
+		<< destructed << " handlers destructed" << std::endl;
+
+	return destructed == NUM_PAIRS ? 0 : 1;
+}
+
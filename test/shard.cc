@@ -0,0 +1,86 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+using namespace mp::placeholders;
+
+static const int NUM_PAIRS = 64;
+static volatile int received = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd, mp::wavy::loop* lo) :
+		mp::wavy::handler(fd),
+		m_lo(lo) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[512];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EINTR || errno == EAGAIN) { return; }
+			throw mp::system_error(errno, "read error");
+		}
+
+		__sync_add_and_fetch(&received, rl);
+	}
+
+private:
+	mp::wavy::loop* m_lo;
+};
+
+void submitted(int* count)
+{
+	__sync_add_and_fetch(count, 1);
+}
+
+int main(void)
+{
+	mp::wavy::loop lo(mp::wavy::loop::sharded(4));
+
+	int peers[NUM_PAIRS];
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		int pair[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		lo.add_handler<handler>(pair[0], &lo);
+		peers[i] = pair[1];
+	}
+
+	int count = 0;
+	for(int i=0; i < 100; ++i) {
+		lo.submit(&submitted, &count);
+	}
+
+	lo.start(4);
+
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		lo.write(peers[i], "test", 4);
+	}
+
+	lo.flush();
+	for(int i=0; i < 1000 && received < NUM_PAIRS*4; ++i) {
+		usleep(1000);
+	}
+
+	lo.end();
+	lo.join();
+
+	std::cout << "received " << received << " bytes, "
+		<< count << " tasks" << std::endl;
+
+	for(int i=0; i < NUM_PAIRS; ++i) {
+		::close(peers[i]);
+	}
+
+	return (received == NUM_PAIRS*4 && count == 100) ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// loop::stats() counts the events, tasks, kernel waits and written bytes
+// while the loop is running.
+
+static const int NUM_WRITES = 100;
+static const int NUM_TASKS = 1000;
+
+static volatile int received = 0;
+static volatile int ran = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd) : mp::wavy::handler(fd) { }
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[16];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl == 0) {
+				throw mp::system_error(errno, "connection closed");
+			}
+			if(errno == EINTR || errno == EAGAIN) { return; }
+			throw mp::system_error(errno, "read error");
+		}
+		__sync_add_and_fetch(&received, rl);
+		e.more();  // read the rest on another turn
+	}
+};
+
+static void task()
+{
+	__sync_add_and_fetch(&ran, 1);
+}
+
+int main(void)
+{
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	mp::wavy::loop lo;
+	lo.add_handler<handler>(pair[0]);
+	lo.start(2);
+
+	for(int i=0; i < NUM_WRITES; ++i) {
+		lo.write(pair[1], "0123456789", 10);
+	}
+	for(int i=0; i < NUM_TASKS; ++i) {
+		lo.submit(&task);
+	}
+	lo.flush();
+
+	for(int i=0; i < 5000 && received < NUM_WRITES*10; ++i) {
+		usleep(1000);
+	}
+
+	mp::wavy::loop::statistics st = lo.stats();
+
+	std::cout
+		<< "events "         << st.events << ", "
+		<< "more "           << st.more << ", "
+		<< "tasks "          << st.tasks << ", "
+		<< "task_queue_max " << st.task_queue_max << ", "
+		<< "polls "          << st.polls << ", "
+		<< "polled "         << st.polled << ", "
+		<< "poll_batch_max " << st.poll_batch_max << ", "
+		<< "out_queue "      << st.out_queue << ", "
+		<< "bytes_written "  << st.bytes_written << ", "
+		<< "write_again "    << st.write_again << std::endl;
+
+	lo.end();
+	lo.join();
+
+	return (received == NUM_WRITES*10 &&
+			st.tasks == (uint64_t)NUM_TASKS &&
+			st.task_queue_max >= 1 &&
+			st.events >= (uint64_t)(NUM_WRITES*10/16) &&
+			st.more >= 1 &&
+			st.polls >= 1 && st.polled >= 1 &&
+			st.poll_batch_max >= 1 &&
+			st.bytes_written == (uint64_t)(NUM_WRITES*10) &&
+			st.out_queue == 0) ? 0 : 1;
+}
+
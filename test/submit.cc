@@ -0,0 +1,63 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <mp/pthread.h>
+#include <vector>
+#include <iostream>
+
+static const int NUM_PRODUCERS = 4;
+static const int NUM_TASKS = 100000;
+
+void task(volatile int* count)
+{
+	__sync_add_and_fetch(count, 1);
+}
+
+void fanout(mp::wavy::loop* lo, volatile int* count)
+{
+	// tasks submitted from a worker go to its local deque
+	for(int i=0; i < 100; ++i) {
+		lo->submit(&task, count);
+	}
+}
+
+void producer_main(mp::wavy::loop* lo, volatile int* count)
+{
+	for(int i=0; i < NUM_TASKS; ++i) {
+		lo->submit(&task, count);
+	}
+}
+
+int main(void)
+{
+	mp::wavy::loop lo;
+	lo.start(4);
+
+	volatile int count = 0;
+
+	std::vector<mp::pthread_thread> threads(NUM_PRODUCERS);
+	for(int i=0; i < NUM_PRODUCERS; ++i) {
+		threads[i].run(mp::bind(&producer_main, &lo, &count));
+	}
+
+	for(int i=0; i < NUM_PRODUCERS; ++i) {
+		threads[i].join();
+	}
+
+	lo.flush();
+
+	volatile int fanout_count = 0;
+	for(int i=0; i < 1000; ++i) {
+		lo.submit(&fanout, &lo, &fanout_count);
+	}
+
+	lo.flush();
+
+	lo.end();
+	lo.join();
+
+	std::cout << count << " tasks, "
+		<< fanout_count << " fan-out tasks" << std::endl;
+
+	return (count == NUM_PRODUCERS*NUM_TASKS &&
+			fanout_count == 1000*100) ? 0 : 1;
+}
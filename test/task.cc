@@ -0,0 +1,111 @@
+#include <mp/wavy.h>
+#include <mp/task.h>
+#include <mp/functional.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <iostream>
+
+// mp::task keeps small function objects inline, and submitting a task
+// with a few bound arguments allocates no memory.
+
+static volatile int allocs = 0;
+
+void* operator new(size_t size)
+{
+	__sync_add_and_fetch(&allocs, 1);
+	void* p = malloc(size ? size : 1);
+	if(!p) { throw std::bad_alloc(); }
+	return p;
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) throw()
+{
+	free(p);
+}
+
+static volatile int live = 0;
+
+struct counted {
+	counted() { ++live; }
+	counted(const counted&) { ++live; }
+	~counted() { --live; }
+};
+
+struct small_fn {
+	small_fn(int* p) : m_p(p) { }
+	void operator() () { ++*m_p; }
+	int* m_p;
+	counted m_c;
+};
+
+struct large_fn {
+	large_fn(int* p) : m_p(p) { memset(m_pad, 0, sizeof(m_pad)); }
+	void operator() () { ++*m_p; }
+	int* m_p;
+	char m_pad[128];
+	counted m_c;
+};
+
+static void task(volatile int* count, int n)
+{
+	__sync_add_and_fetch(count, n);
+}
+
+int main(void)
+{
+	bool ok = true;
+
+	{
+		int n = 0;
+		int before = allocs;
+		mp::task a = small_fn(&n);
+		mp::task b;
+		b.swap(a);
+		b();
+		mp::task c(b);
+		c();
+		ok = ok && a.empty() && n == 2 && allocs == before;
+		std::cout << "small: " << allocs - before << " allocations" << std::endl;
+
+		before = allocs;
+		mp::task d = large_fn(&n);
+		d.swap(b);
+		b();
+		ok = ok && n == 3 && allocs == before + 1;
+		std::cout << "large: " << allocs - before << " allocations" << std::endl;
+	}
+	ok = ok && live == 0;
+
+	mp::wavy::loop lo;
+	lo.start(2);
+
+	volatile int count = 0;
+	for(int i=0; i < 100; ++i) {
+		lo.submit(&task, &count, 1);
+	}
+	lo.flush();
+
+	int before = allocs;
+	for(int i=0; i < 500; ++i) {
+		lo.submit(&task, &count, 1);
+		lo.submit(mp::wavy::loop::PRIORITY_HIGH, &task, &count, 1);
+	}
+	lo.flush();
+	int submit_allocs = allocs - before;
+
+	lo.end();
+	lo.join();
+
+	std::cout << count << " tasks, "
+		<< submit_allocs << " allocations while submitting" << std::endl;
+	ok = ok && count == 1100 && submit_allocs == 0;
+
+	return ok ? 0 : 1;
+}
+
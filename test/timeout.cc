@@ -0,0 +1,128 @@
+#include <mp/wavy.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <iostream>
+
+// Handlers are timed out by set_idle_timeout() when no data comes, and
+// not while it does. set_deadline() times out a handler whether data
+// comes or not.
+
+static const int CONNS = 30;  // silent, busy and with a deadline
+static const double IDLE = 0.1;
+static const double DEADLINE = 0.2;
+static const int BUSY_MSEC = 400;
+
+static uint64_t now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t started;
+static volatile uint64_t closed_at[CONNS];
+static volatile int timeouts[CONNS];
+static volatile int closed = 0;
+
+class handler : public mp::wavy::handler {
+public:
+	handler(int fd, int conn) :
+		mp::wavy::handler(fd), m_conn(conn)
+	{
+		if(m_conn % 3 == 2) {
+			set_deadline(DEADLINE);
+		} else {
+			set_idle_timeout(IDLE);
+		}
+	}
+
+	void on_read(mp::wavy::event& e)
+	{
+		char buf[64];
+		ssize_t rl = read(fd(), buf, sizeof(buf));
+		if(rl <= 0) {
+			if(rl < 0 && (errno == EAGAIN || errno == EINTR)) {
+				return;
+			}
+			closed_at[m_conn] = now_msec() - started;
+			__sync_add_and_fetch(&closed, 1);
+			e.remove();
+		}
+	}
+
+	void on_timeout()
+	{
+		__sync_add_and_fetch(&timeouts[m_conn], 1);
+		mp::wavy::handler::on_timeout();
+	}
+
+private:
+	int m_conn;
+};
+
+int main(void)
+{
+	int pairs[CONNS][2];
+	signal(SIGPIPE, SIG_IGN);  // the peers of the deadline are shut down
+
+	mp::wavy::loop lo;
+	lo.start(2);
+
+	started = now_msec();
+	for(int c=0; c < CONNS; ++c) {
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[c]) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+		lo.add_handler<handler>(pairs[c][0], c);
+	}
+
+	// all but the silent ones get data every 20ms
+	while(now_msec() - started < (uint64_t)BUSY_MSEC) {
+		for(int c=0; c < CONNS; ++c) {
+			if(c % 3 != 0) {
+				write(pairs[c][1], "x", 1);
+			}
+		}
+		usleep(20*1000);
+	}
+
+	for(int i=0; i < 2000 && closed < CONNS; ++i) {
+		usleep(1000);
+	}
+
+	lo.end();
+	lo.join();
+
+	bool ok = (closed == CONNS);
+	for(int c=0; c < CONNS; ++c) {
+		uint64_t at = closed_at[c];
+		uint64_t min, max;
+		switch(c % 3) {
+		case 0:  // silent
+			min = IDLE*1000;  max = IDLE*1000 + 100;
+			break;
+		case 1:  // busy until BUSY_MSEC
+			min = BUSY_MSEC;  max = BUSY_MSEC + IDLE*1000 + 100;
+			break;
+		default:
+			min = DEADLINE*1000;  max = DEADLINE*1000 + 100;
+			break;
+		}
+		if(timeouts[c] != 1 || at < min || at > max) {
+			std::cout << "conn " << c << " closed at " << at
+				<< "ms, timeouts " << timeouts[c] << std::endl;
+			ok = false;
+		}
+		close(pairs[c][1]);
+	}
+
+	std::cout << "closed " << closed << std::endl;
+
+	return ok ? 0 : 1;
+}
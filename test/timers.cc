@@ -0,0 +1,119 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdint.h>
+#include <iostream>
+
+// Many one-shot timers don't take a file descriptor each. Removed
+// timers don't run, and the others run once and not before their time.
+// A slow callback doesn't hold up the other timers.
+
+static const int TIMERS = 100000;
+
+static uint64_t now_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static volatile int fired = 0;
+static volatile int removed_fired = 0;
+static volatile int early = 0;
+static volatile int periodic = 0;
+
+static bool on_timer(uint64_t deadline, bool removed)
+{
+	if(now_msec() < deadline) {
+		__sync_add_and_fetch(&early, 1);
+	}
+	if(removed) {
+		__sync_add_and_fetch(&removed_fired, 1);
+	}
+	__sync_add_and_fetch(&fired, 1);
+	return true;  // ignored by one-shot timers
+}
+
+static bool on_periodic()
+{
+	return __sync_add_and_fetch(&periodic, 1) < 5;
+}
+
+static bool on_slow()
+{
+	usleep(500*1000);
+	return false;
+}
+
+static volatile uint64_t fast_at = 0;
+
+static bool on_fast()
+{
+	fast_at = now_msec();
+	return false;
+}
+
+static int next_fd()
+{
+	int fd = dup(0);
+	close(fd);
+	return fd;
+}
+
+int main(void)
+{
+	mp::wavy::loop lo;
+	lo.start(2);
+
+	int fd_before = next_fd();
+
+	srand(1);
+	int expected = 0;
+	for(int i=0; i < TIMERS; ++i) {
+		int msec = 1 + rand() % 300;
+		if(i % 1000 == 0) {
+			msec = 300 + rand() % 2000;  // on the upper wheels
+		}
+		bool remove = (i % 3 == 0);
+		int ident = lo.add_timer(msec / 1000.0, 0.0, mp::bind(
+					&on_timer, now_msec() + msec, remove));
+		if(remove) {
+			lo.remove_timer(ident);
+		} else {
+			++expected;
+		}
+	}
+
+	lo.add_timer(0.01, 0.01, &on_periodic);
+
+	int fd_after = next_fd();
+
+	for(int i=0; i < 5000 && (fired < expected || periodic < 5); ++i) {
+		usleep(1000);
+	}
+	usleep(100*1000);
+
+	uint64_t fast_added = now_msec();
+	lo.add_timer(0.005, 0.0, &on_slow);
+	lo.add_timer(0.02, 0.0, &on_fast);
+	for(int i=0; i < 1000 && fast_at == 0; ++i) {
+		usleep(1000);
+	}
+	uint64_t fast_delay = fast_at ? fast_at - fast_added : 0;
+
+	lo.end();
+	lo.join();
+
+	std::cout
+		<< "fired " << fired << " of " << expected << ", "
+		<< "removed fired " << removed_fired << ", "
+		<< "early " << early << ", "
+		<< "periodic " << periodic << ", "
+		<< "behind a slow one " << fast_delay << "ms" << std::endl;
+
+	return (fd_before == fd_after && fired == expected &&
+			removed_fired == 0 && early == 0 && periodic == 5 &&
+			fast_at != 0 && fast_delay < 300) ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#include <mp/wavy.h>
+#include <mp/functional.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+// With one thread the only worker blocks in the kernel. A task submitted
+// from another thread, and end(), must wake it up instead of waiting for
+// the poll timeout.
+
+static double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void task(volatile double* started)
+{
+	*started = now();
+}
+
+int main(void)
+{
+	mp::wavy::loop lo;
+	lo.start(1);
+
+	double max = 0;
+	for(int i=0; i < 20; ++i) {
+		usleep(20*1000);  // let the worker block in the kernel
+
+		volatile double started = 0;
+		double submitted = now();
+		lo.submit(&task, &started);
+
+		while(started == 0) {
+			usleep(100);
+		}
+		if(started - submitted > max) {
+			max = started - submitted;
+		}
+	}
+
+	usleep(20*1000);
+	double ending = now();
+	lo.end();
+	lo.join();
+	double ended = now() - ending;
+
+	std::cout << "submit latency max " << max*1e3 << " msec, "
+		<< "end latency " << ended*1e3 << " msec" << std::endl;
+
+	return (max < 0.2 && ended < 0.2) ? 0 : 1;
+}
+